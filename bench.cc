@@ -0,0 +1,336 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <time.h>
+#include <algorithm>
+#include "dns_db.h"
+
+/**
+ * Read path benchmarks
+ *
+ *  bench dbpath read-scaling [seconds]
+ *    Runs hasDomain (hits and misses) and domain iterators with getIpsv4
+ *    on 1, 2, 4... threads (up to the number of cores) and reports the
+ *    throughput of each run
+ *
+ *  bench - index-lookup
+ *    Looks up random domains in index node directories of 10K, 100K and
+ *    1M nodes, with the previous layout (sorted vector of nodes) and the
+ *    B+tree, and reports ns/lookup
+ *
+ *  bench - key-compare
+ *    Compares keys with strncmp and with the word wise comparison, on
+ *    neighbouring keys (sorted, long shared prefixes) and random pairs,
+ *    and reports ns/compare
+ *
+ *  bench dbpath block-lookup
+ *    Looks up domains (hits and misses) inside their blocks, bypassing the
+ *    index and the filters, and reports ns/lookup. The search depends on
+ *    the build: linear scan, FAST_SEARCH or SLOT_DIRECTORY (make bench
+ *    OPTS="...")
+ *
+**/
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Cheap per thread PRNG (xorshift)
+static inline uint64_t next_rand(uint64_t & s) {
+	s ^= s << 13;
+	s ^= s >> 7;
+	s ^= s << 17;
+	return s;
+}
+
+static void read_scaling(DNS_DB & db, double seconds) {
+	// Sample of existing domains, and the same domains with a prefix so they miss
+	std::vector <std::string> hits, misses;
+	for (DNS_DB::DomainIterator it = db.getDomainIterator(); !it.end() && hits.size() < 100000; it.next())
+		hits.push_back(it.getDomain());
+	if (hits.empty()) {
+		fprintf(stderr, "The DB is empty!\n");
+		return;
+	}
+	for (unsigned int i = 0; i < hits.size(); i++)
+		misses.push_back("zz9-" + hits[i]);
+
+	unsigned int maxthreads = std::thread::hardware_concurrency();
+	if (maxthreads < 1) maxthreads = 1;
+
+	printf("%8s %14s %14s %14s\n", "threads", "hasDomain/s", "iterate/s", "total/s");
+	for (unsigned int nt = 1; ; nt *= 2) {
+		if (nt > maxthreads) nt = maxthreads;
+
+		std::atomic <unsigned long> lookups(0), iterated(0);
+		volatile bool stop = false;
+		std::vector <std::thread> threads;
+		for (unsigned int t = 0; t < nt; t++) {
+			threads.push_back(std::thread([&, t]() {
+				uint64_t s = 0x9e3779b97f4a7c15ULL * (t+1);
+				unsigned long nl = 0, ni = 0;
+				while (!stop) {
+					// Mostly point lookups, plus a short range read every now and then
+					for (int i = 0; i < 64; i++) {
+						const std::vector <std::string> & v = (next_rand(s) & 1) ? hits : misses;
+						db.hasDomain(v[next_rand(s) % v.size()]);
+						nl++;
+					}
+					DNS_DB::DomainIterator it = db.getDomainIterator(hits[next_rand(s) % hits.size()]);
+					for (int i = 0; i < 16 && !it.end(); i++, it.next()) {
+						it.getIpsv4();
+						ni++;
+					}
+				}
+				lookups += nl;
+				iterated += ni;
+			}));
+		}
+
+		double t0 = now_sec();
+		struct timespec ts = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+		nanosleep(&ts, 0);
+		stop = true;
+		for (unsigned int t = 0; t < threads.size(); t++)
+			threads[t].join();
+		double el = now_sec() - t0;
+
+		printf("%8u %14.0f %14.0f %14.0f\n", nt, lookups / el, iterated / el, (lookups + iterated) / el);
+		fflush(stdout);
+
+		if (nt == maxthreads)
+			break;
+	}
+}
+
+// Has access to the DB internals
+class Bench {
+public:
+	static void indexLookup();
+	static void blockLookup(DNS_DB & db);
+
+private:
+	// Node directory as it was before the B+tree, with its search
+	struct __attribute__ ((__packed__)) VectorNode {
+		char min[MAX_DNS_SIZE];
+		char max[MAX_DNS_SIZE];
+		uint32_t dnsblock_id;
+	};
+
+	static int vectorLookup(const std::vector <VectorNode> & nodes, const char * domain) {
+		int first = 0, last = nodes.size()-1;
+		while (first <= last) {
+			int middle = (first+last)>>1;
+			const VectorNode * n = &nodes[middle];
+			if ( less_eq(n->min, domain) && less(domain, n->max) )
+				return middle;
+			else if less_eq(domain, n->min)
+				last = middle - 1;
+			else
+				first = middle + 1;
+		}
+		return -1;
+	}
+};
+
+// Random internal domain (lowercase label and a TLD code)
+static std::string random_idom(uint64_t & s) {
+	char d[MAX_DNS_SIZE];
+	memset(d, 0, sizeof(d));
+	int len = 4 + next_rand(s) % 16;
+	for (int i = 0; i < len; i++)
+		d[i] = 'a' + next_rand(s) % 26;
+	d[len] = 1 + next_rand(s) % 8;
+	return std::string(d, MAX_DNS_SIZE);
+}
+
+static void key_compare() {
+	const unsigned int nkeys = 1000000, rounds = 20;
+	uint64_t s = 0x9e3779b97f4a7c15ULL;
+	std::vector <std::string> keys;
+	for (unsigned int i = 0; i < nkeys; i++)
+		keys.push_back(random_idom(s));
+	std::sort(keys.begin(), keys.end());
+
+	// Neighbours (i, i+1) and random pairs (i, perm[i])
+	std::vector <unsigned int> perm(nkeys);
+	for (unsigned int i = 0; i < nkeys; i++)
+		perm[i] = (i + 1) % nkeys;
+	std::vector <unsigned int> rnd(perm);
+	for (unsigned int i = nkeys-1; i > 0; i--)
+		std::swap(rnd[i], rnd[next_rand(s) % (i+1)]);
+
+	std::vector <char> flat((unsigned long)nkeys * MAX_DNS_SIZE);
+	for (unsigned int i = 0; i < nkeys; i++)
+		memcpy(&flat[(unsigned long)i*MAX_DNS_SIZE], keys[i].data(), MAX_DNS_SIZE);
+	const char * k = &flat[0];
+
+	printf("%10s %16s %16s\n", "pairs", "strncmp ns/op", "words ns/op");
+	for (int t = 0; t < 2; t++) {
+		const std::vector <unsigned int> & other = t ? rnd : perm;
+		long sum_str = 0, sum_word = 0;
+		double t0 = now_sec();
+		for (unsigned int r = 0; r < rounds; r++)
+			for (unsigned int i = 0; i < nkeys; i++)
+				sum_str += strncmp(&k[(unsigned long)i*MAX_DNS_SIZE], &k[(unsigned long)other[i]*MAX_DNS_SIZE], MAX_DNS_SIZE) < 0;
+		double t1 = now_sec();
+		for (unsigned int r = 0; r < rounds; r++)
+			for (unsigned int i = 0; i < nkeys; i++)
+				sum_word += less(&k[(unsigned long)i*MAX_DNS_SIZE], &k[(unsigned long)other[i]*MAX_DNS_SIZE]);
+		double t2 = now_sec();
+
+		if (sum_str != sum_word)
+			fprintf(stderr, "Comparison results differ!\n");
+		printf("%10s %16.2f %16.2f\n", t ? "random" : "neighbours", (t1-t0)*1e9/(rounds*nkeys), (t2-t1)*1e9/(rounds*nkeys));
+		fflush(stdout);
+	}
+}
+
+void Bench::indexLookup() {
+	const unsigned int sizes[3] = { 10000, 100000, 1000000 };
+	const unsigned int nlookups = 2000000;
+
+	printf("%8s %14s %14s\n", "nodes", "vector ns/op", "btree ns/op");
+	for (unsigned int t = 0; t < 3; t++) {
+		uint64_t s = 0x9e3779b97f4a7c15ULL;
+		std::vector <std::string> keys(1, std::string(MAX_DNS_SIZE, 0));
+		while (keys.size() < sizes[t])
+			keys.push_back(random_idom(s));
+		std::sort(keys.begin(), keys.end(), [](const std::string & a, const std::string & b) { return less(a.data(), b.data()); });
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+		std::vector <VectorNode> vnodes(keys.size());
+		for (unsigned int i = 0; i < keys.size(); i++) {
+			memcpy(vnodes[i].min, keys[i].data(), MAX_DNS_SIZE);
+			if (i+1 < keys.size())
+				memcpy(vnodes[i].max, keys[i+1].data(), MAX_DNS_SIZE);
+			else
+				memset(vnodes[i].max, ~0, MAX_DNS_SIZE);
+			vnodes[i].dnsblock_id = i;
+		}
+
+		// The tree is built by inserting in random order, as splits do
+		std::vector <unsigned int> order(keys.size());
+		for (unsigned int i = 0; i < order.size(); i++)
+			order[i] = i;
+		for (unsigned int i = order.size()-1; i > 0; i--)
+			std::swap(order[i], order[next_rand(s) % (i+1)]);
+		DNS_DB::DnsIndex::NodeTree tree;
+		for (unsigned int i = 0; i < order.size(); i++) {
+			DNS_DB::DnsIndex::Node n;
+			memset(&n, 0, sizeof(n));
+			memcpy(&n, &vnodes[order[i]], sizeof(VectorNode));
+			tree.insert(n);
+		}
+
+		std::vector <char> queries((unsigned long)nlookups * MAX_DNS_SIZE);
+		for (unsigned int i = 0; i < nlookups; i++)
+			memcpy(&queries[(unsigned long)i*MAX_DNS_SIZE], random_idom(s).data(), MAX_DNS_SIZE);
+
+		unsigned long sum_vector = 0, sum_tree = 0;
+		double t0 = now_sec();
+		for (unsigned int i = 0; i < nlookups; i++)
+			sum_vector += vectorLookup(vnodes, &queries[(unsigned long)i*MAX_DNS_SIZE]);
+		double t1 = now_sec();
+		for (unsigned int i = 0; i < nlookups; i++)
+			sum_tree += tree.find(&queries[(unsigned long)i*MAX_DNS_SIZE]);
+		double t2 = now_sec();
+
+		if (sum_vector != sum_tree)
+			fprintf(stderr, "Lookup results differ!\n");
+		printf("%8lu %14.1f %14.1f\n", (unsigned long)keys.size(), (t1-t0)*1e9/nlookups, (t2-t1)*1e9/nlookups);
+		fflush(stdout);
+	}
+}
+
+void Bench::blockLookup(DNS_DB & db) {
+	#if defined(SLOT_DIRECTORY)
+	const char * search = "slot directory";
+	#elif defined(FAST_SEARCH)
+	const char * search = "fast search";
+	#else
+	const char * search = "linear";
+	#endif
+
+	// Existing domains and the same ones with a prefix, with their blocks
+	std::vector <std::string> keys;
+	std::vector <DNS_DB::DnsBlockPtr> blocks;
+	for (DNS_DB::DomainIterator it = db.getDomainIterator(); !it.end(); it.next()) {
+		for (int miss = 0; miss < 2; miss++) {
+			char domint[MAX_DNS_SIZE];
+			if (!domain2idom(((miss ? "zz9-" : "") + it.getDomain()).c_str(), domint))
+				continue;
+			keys.push_back(std::string(domint, MAX_DNS_SIZE));
+			blocks.push_back(db.getBlock(db.index.getBlockId(db.index.lookupNode(domint))));
+		}
+	}
+	if (keys.empty()) {
+		fprintf(stderr, "The DB is empty!\n");
+		return;
+	}
+
+	// Random order, so the lookups jump across blocks
+	uint64_t s = 0x9e3779b97f4a7c15ULL;
+	for (unsigned int i = keys.size()-1; i > 0; i--) {
+		unsigned int j = next_rand(s) % (i+1);
+		std::swap(keys[i], keys[j]);
+		std::swap(blocks[i], blocks[j]);
+	}
+
+	unsigned long found = 0, nlookups = 0;
+	double t0 = now_sec();
+	while (now_sec() - t0 < 2) {
+		for (unsigned int i = 0; i < keys.size(); i++)
+			found += blocks[i]->hasDomain(keys[i].data());
+		nlookups += keys.size();
+	}
+	double el = now_sec() - t0;
+
+	printf("%s: %lu lookups (%.1f%% found) in %lu blocks, %.1f ns/lookup\n", search, nlookups,
+		100.0 * found / nlookups, (unsigned long)db.index.getNumNodes(), el*1e9/nlookups);
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s dbpath benchmark (args...)\n", argv[0]);
+		fprintf(stderr, " Benchmarks:\n");
+		fprintf(stderr, "  * read-scaling [seconds]\n");
+		fprintf(stderr, "  * index-lookup (no DB needed, use - as dbpath)\n");
+		fprintf(stderr, "  * key-compare (no DB needed)\n");
+		fprintf(stderr, "  * block-lookup\n");
+		exit(0);
+	}
+
+	std::string pathdb = std::string(argv[1]);
+	std::string bench  = std::string(argv[2]);
+
+	if (bench == "index-lookup") {
+		Bench::indexLookup();
+		return 0;
+	}
+	if (bench == "key-compare") {
+		key_compare();
+		return 0;
+	}
+
+	DNS_DB db(pathdb);
+
+	if (bench == "read-scaling") {
+		read_scaling(db, argc > 3 ? atof(argv[3]) : 2);
+	}
+	else if (bench == "block-lookup") {
+		Bench::blockLookup(db);
+	}
+	else {
+		fprintf(stderr, "Unknown benchmark %s\n", bench.c_str());
+		return 1;
+	}
+	return 0;
+}
+
@@ -8,38 +8,73 @@
 #include <assert.h>
 #include "dns_db.h"
 
-DNS_DB::Bitmap::Bitmap(int numBits) : bitm(numBits/(8*sizeof(unsigned int))) {}
+DNS_DB::Bitmap::Bitmap(int numBits, void * mem) : bitm((uint64_t *)mem), nwords(numBits/64), count(0),
+	nonzero((nwords+63)/64), nonfull((nwords+63)/64) {
 
-int DNS_DB::Bitmap::getFirst(bool value) const {
-	for (unsigned int idx = 0; idx < bitm.size(); idx++) {
-		for (unsigned int off = 0; off < sizeof(unsigned int)*8; off++) {
-			if (((bitm[idx] & (1<<off)) != 0) == value)
-				return idx*sizeof(unsigned int)*8 + off;
-		}
+	assert(numBits % 64 == 0);
+	for (unsigned int i = 0; i < nwords; i++) {
+		count += __builtin_popcountll(bitm[i]);
+		summarize(i);
 	}
-	return -1;
 }
 
-int DNS_DB::Bitmap::getRightSet(unsigned int pos) const {
-	unsigned int residue = pos%(8*sizeof(unsigned int));
-	unsigned int mask = ((~0)<<residue);
-	for (unsigned int idx = pos/(8*sizeof(unsigned int)); idx < bitm.size(); idx++) {
-		unsigned int val = bitm[idx] & mask;
-		if (val != 0) {
-			unsigned int off = __builtin_ctz(val);
-			return idx*sizeof(unsigned int)*8 + off;
-		}
-		mask = ~0;
+void DNS_DB::Bitmap::clear() {
+	memset(bitm, 0, nwords * sizeof(uint64_t));
+	count = 0;
+	for (unsigned int i = 0; i < nwords; i++)
+		summarize(i);
+}
+
+// Number of bits set in [from, to)
+int DNS_DB::Bitmap::countRange(unsigned int from, unsigned int to) const {
+	int n = 0;
+	for (unsigned int i = from / 64; i * 64 < to; i++) {
+		uint64_t w = bitm[i];
+		if (i == from / 64)
+			w &= ~0ULL << (from % 64);
+		if ((i+1) * 64 > to)
+			w &= ~0ULL >> (64 - to % 64);
+		n += __builtin_popcountll(w);
 	}
-	return -1;
+	return n;
 }
 
-int DNS_DB::Bitmap::bitCount() const {
-	int ret = 0;
-	for (unsigned int i = 0; i < bitm.size(); i++) {
-		ret += __builtin_popcount(bitm[i]);
+// First word from idx (included) with its bit set in the summary, -1 if none
+int DNS_DB::Bitmap::nextWord(const std::vector <uint64_t> & summary, unsigned int idx) const {
+	if (idx >= nwords)
+		return -1;
+	unsigned int s = idx / 64;
+	uint64_t v = summary[s] & (~0ULL << (idx % 64));
+	while (v == 0) {
+		if (++s >= summary.size())
+			return -1;
+		v = summary[s];
 	}
-	return ret;
+	return s*64 + __builtin_ctzll(v);
 }
 
+int DNS_DB::Bitmap::getFirst(bool value) const {
+	int idx = nextWord(value ? nonzero : nonfull, 0);
+	if (idx < 0)
+		return -1;
+	uint64_t w = value ? bitm[idx] : ~bitm[idx];
+	return idx*64 + __builtin_ctzll(w);
+}
+
+int DNS_DB::Bitmap::getRightSet(unsigned int pos) const {
+	unsigned int idx = pos / 64;
+	if (idx >= nwords)
+		return -1;
+
+	// Rest of the first word, then skip to the next non empty one
+	uint64_t w = bitm[idx] & (~0ULL << (pos % 64));
+	if (w == 0) {
+		int next = nextWord(nonzero, idx + 1);
+		if (next < 0)
+			return -1;
+		idx = next;
+		w = bitm[idx];
+	}
+	return idx*64 + __builtin_ctzll(w);
+}
 
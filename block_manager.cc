@@ -1,55 +1,99 @@
 
+
 #include "dns_db.h"
 
 DNS_DB::DnsBlockPtr DNS_DB::BlockManager::getBlock(int id) {
-	if (blocks.find(id) == blocks.end()) {
-		DnsBlock * nbl = db->getNewBlock(id);
-		CachedBlock cb;
-		cb.b.reset(nbl);
-		
-		blocks.insert({id, cb});
-
-		if (blocks.size() > BlockManager_flush_trigger)
-			flushUnusedBlocks();
+	{
+		ReadGuard g(lock);
+		std::unordered_map < int, unsigned int >::iterator it = blocks.find(id);
+		if (it != blocks.end()) {
+			CachedBlock & cb = slots[it->second];
+			__atomic_store_n(&cb.referenced, true, __ATOMIC_RELAXED);
+			hits++;
+			return cb.b;
+		}
 	}
-	return blocks.at(id).b;
+
+	// Miss, somebody else might have loaded it while we waited for the lock
+	WriteGuard g(lock);
+	std::unordered_map < int, unsigned int >::iterator it = blocks.find(id);
+	if (it != blocks.end()) {
+		CachedBlock & cb = slots[it->second];
+		__atomic_store_n(&cb.referenced, true, __ATOMIC_RELAXED);
+		hits++;
+		return cb.b;
+	}
+
+	misses++;
+	unsigned int s;
+	if (free_slots.empty()) {
+		s = slots.size();
+		slots.push_back(CachedBlock());
+	}
+	else {
+		s = free_slots.back();
+		free_slots.pop_back();
+	}
+
+	CachedBlock & cb = slots[s];
+	cb.id = id;
+	cb.b.reset(db->getNewBlock(id));
+	__atomic_store_n(&cb.referenced, true, __ATOMIC_RELAXED);
+	blocks.insert({id, s});
+
+	// Hold a reference so the new block is not picked as victim
+	DnsBlockPtr ret = cb.b;
+	if (blocks.size() > BlockManager_flush_trigger)
+		flushUnusedBlocks();
+	return ret;
 }
 
+void DNS_DB::BlockManager::dropBlock(int id) {
+	WriteGuard g(lock);
+	std::unordered_map < int, unsigned int >::iterator it = blocks.find(id);
+	if (it == blocks.end())
+		return;
+
+	CachedBlock & cb = slots[it->second];
+	blocks.erase(it);
+	cb.b.reset();
+	cb.id = -1;
+	free_slots.push_back(&cb - &slots[0]);
+}
 
 void DNS_DB::BlockManager::flushUnusedBlocks() {
-	// Remove the blocks with less "t"
-	while (blocks.size() > BlockManager_flush_maximum) {
-		// Look for candidate:
-		unsigned long min = (unsigned)~0;
-		std::map < int, CachedBlock >::iterator cand = blocks.end();
-		for (std::map< int, CachedBlock >::iterator it = blocks.begin(); it != blocks.end(); ++it) {
-			if (it->second.t < min) {
-				if (it->second.b.use_count() == 1) {
-					cand = it;
-					min = it->second.t;
-				}
-			}
-		}
+	// Two full turns without finding a victim means everything is in use
+	unsigned int visited = 0;
+	while (blocks.size() > BlockManager_flush_maximum && visited < 2*slots.size()) {
+		CachedBlock & cb = slots[hand];
+		hand = (hand + 1) % slots.size();
+		visited++;
 
-		// Now delete this block if there is only one reference to it
-		if (min != (unsigned)~0) {
-			assert(cand->second.b.use_count() == 1);
-			blocks.erase(cand);
-		}
-		else
-			break;
+		if (cb.id < 0)
+			continue;
+
+		if (__atomic_exchange_n(&cb.referenced, false, __ATOMIC_RELAXED) || cb.b.use_count() > 1)
+			continue;
+
+		// Now delete this block, there is only one reference to it
+		blocks.erase(cb.id);
+		cb.b.reset();
+		cb.id = -1;
+		free_slots.push_back(&cb - &slots[0]);
+		evictions++;
+		visited = 0;
 	}
 
 	// Make sure no repeated IDs
 	#ifdef EXTRA_CHECK
 	std::map <int,int> rep;
-	for (std::map< int, CachedBlock >::iterator it = blocks.begin(); it != blocks.end(); ++it) {
-		int id = it->second.b->getID();
+	for (unsigned int i = 0; i < slots.size(); i++) {
+		if (slots[i].id < 0) continue;
+		int id = slots[i].b->getID();
 		assert (rep[id] == 0);
+		assert (blocks.at(id) == i);
 		rep[id]++;
 	}
 	#endif
 }
 
-
-
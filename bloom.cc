@@ -0,0 +1,178 @@
+
+#include <string>
+#include <string.h>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dns_db.h"
+
+/** Block Bloom filters */
+
+// File format: 4 byte magic, filter size, number of hashes and number of
+// filters (4 bytes each), then one valid byte per filter and the filters
+
+#define BLOOM_MAGIC   0x31464c42   // "BLF1"
+
+static uint64_t bloom_hash(const void * key, int len) {
+	// FNV-1a and a murmur finalizer to spread the bits
+	const uint8_t * p = (const uint8_t *)key;
+	uint64_t h = 14695981039346656037ULL;
+	for (int i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+void DNS_DB::BlockBloomFilter::load(const std::string & file) {
+	this->file = file;
+	filters.clear();
+	valid.clear();
+
+	FILE * fd = fopen(file.c_str(), "rb");
+	if (fd == NULL)
+		return;
+
+	uint32_t hdr[4];
+	if (fread(hdr, 1, sizeof(hdr), fd) == sizeof(hdr) &&
+		hdr[0] == BLOOM_MAGIC && hdr[1] == fbytes && hdr[2] == nhashes) {
+
+		valid.resize(hdr[3]);
+		filters.resize((unsigned long)hdr[3] * fbytes);
+		if (fread(&valid[0], 1, valid.size(), fd) != valid.size() ||
+			fread(&filters[0], 1, filters.size(), fd) != filters.size()) {
+
+			fprintf(stderr, "Warning: Could not read Bloom filters %s!\n", file.c_str());
+			filters.clear();
+			valid.clear();
+		}
+	}
+	fclose(fd);
+}
+
+void DNS_DB::BlockBloomFilter::save() {
+	if (file.empty())
+		return;
+
+	FILE * fd = fopen(file.c_str(), "wb");
+	if (fd == NULL) {
+		fprintf(stderr, "Could not write Bloom filters %s!\n", file.c_str());
+		return;
+	}
+	uint32_t hdr[4] = { BLOOM_MAGIC, fbytes, nhashes, (uint32_t)valid.size() };
+	fwrite(hdr, 1, sizeof(hdr), fd);
+	if (!valid.empty()) {
+		fwrite(&valid[0], 1, valid.size(), fd);
+		fwrite(&filters[0], 1, filters.size(), fd);
+	}
+	fclose(fd);
+}
+
+// Makes room for the filters of nblocks blocks (invalid until set)
+void DNS_DB::BlockBloomFilter::reserve(unsigned int nblocks) {
+	if (nblocks > valid.size()) {
+		valid.resize(nblocks, 0);
+		filters.resize((unsigned long)nblocks * fbytes, 0);
+	}
+}
+
+// Resets the filter of a block to empty (and valid)
+void DNS_DB::BlockBloomFilter::clear(unsigned int blkid) {
+	reserve(blkid + 1);
+	memset(&filters[(unsigned long)blkid * fbytes], 0, fbytes);
+	valid[blkid] = 1;
+}
+
+void DNS_DB::BlockBloomFilter::add(unsigned int blkid, const void * key, int len) {
+	if (!isValid(blkid))
+		return;
+
+	setBits(&filters[(unsigned long)blkid * fbytes], key, len);
+}
+
+void DNS_DB::BlockBloomFilter::addTo(std::vector <uint8_t> & f, const void * key, int len) const {
+	setBits(&f[0], key, len);
+}
+
+// Copies the filter and marks it as valid after that, so concurrent
+// readers either see it invalid (matching anything) or complete
+void DNS_DB::BlockBloomFilter::set(unsigned int blkid, const std::vector <uint8_t> & f) {
+	std::lock_guard <std::mutex> g(publish);
+	assert(blkid < valid.size() && f.size() == fbytes);
+	__atomic_store_n(&valid[blkid], 0, __ATOMIC_RELEASE);
+	memcpy(&filters[(unsigned long)blkid * fbytes], &f[0], fbytes);
+	__atomic_store_n(&valid[blkid], 1, __ATOMIC_RELEASE);
+}
+
+void DNS_DB::BlockBloomFilter::setBits(uint8_t * f, const void * key, int len) const {
+	uint64_t h = bloom_hash(key, len);
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	for (unsigned int i = 0; i < nhashes; i++) {
+		uint32_t bit = (h1 + i*h2) % (fbytes*8);
+		f[bit >> 3] |= (1 << (bit & 7));
+	}
+}
+
+bool DNS_DB::BlockBloomFilter::mayContain(unsigned int blkid, const void * key, int len) const {
+	if (!isValid(blkid))
+		return true;
+
+	const uint8_t * f = &filters[(unsigned long)blkid * fbytes];
+	uint64_t h = bloom_hash(key, len);
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	for (unsigned int i = 0; i < nhashes; i++) {
+		uint32_t bit = (h1 + i*h2) % (fbytes*8);
+		if (!(f[bit >> 3] & (1 << (bit & 7))))
+			return false;
+	}
+	return true;
+}
+
+// Average (over the valid filters) of the false positive probability,
+// estimated from the fraction of bits set
+double DNS_DB::BlockBloomFilter::getFalsePositiveRate() const {
+	double sum = 0;
+	unsigned int n = 0;
+	for (unsigned int b = 0; b < valid.size(); b++) {
+		if (!valid[b])
+			continue;
+		const uint64_t * f = (const uint64_t *)&filters[(unsigned long)b * fbytes];
+		unsigned int bits = 0;
+		for (unsigned int i = 0; i < fbytes/8; i++)
+			bits += __builtin_popcountll(f[i]);
+
+		double fill = bits / (fbytes*8.0);
+		double p = 1;
+		for (unsigned int i = 0; i < nhashes; i++)
+			p *= fill;
+		sum += p;
+		n++;
+	}
+	return n ? sum / n : 0;
+}
+
+void DNS_DB::IpBloomFilter::rebuild(const DnsBlockPtr & blk) {
+	std::vector <uint8_t> f = newFilter();
+	blk->scanIpsv4([&](const char *, const IPv4_Record & rec) {
+		addTo(f, &rec.ip, sizeof(rec.ip));
+	});
+	reserve(blk->getID() + 1);
+	set(blk->getID(), f);
+}
+
+void DNS_DB::DomainBloomFilter::rebuild(const DnsBlockPtr & blk) {
+	std::vector <uint8_t> f = newFilter();
+	blk->scanDomains([&](const char * domint) {
+		addTo(f, domint, MAX_DNS_SIZE);
+	});
+	reserve(blk->getID() + 1);
+	set(blk->getID(), f);
+}
+
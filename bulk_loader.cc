@@ -0,0 +1,193 @@
+
+#include <string>
+#include <algorithm>
+#include <queue>
+#include <string.h>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include "dns_db.h"
+
+/** Bulk loader */
+
+// Domains are buffered (already in internal format) and sorted in runs of
+// BULK_RUN_DOMAINS, which are spilled to disk. At finish() all the runs are
+// merged and the resulting sorted stream is written into fresh blocks, so
+// each block is written exactly once and the index is built in one pass.
+
+#define RUN_IO_BUFFER  (1024*1024)
+
+struct RunKey {
+	char d[MAX_DNS_SIZE];
+	bool operator<(const RunKey & o) const { return less(d, o.d); }
+};
+
+DNS_DB::BulkLoader::BulkLoader(DNS_DB * dbref, float fill) : db(dbref), first_block(true), has_last(false), num_added(0), num_dups(0), num_runs(0) {
+	keys_per_block = (int)(DnsBlock::numBlocks * fill);
+	if (keys_per_block < 1) keys_per_block = 1;
+	if (keys_per_block > (int)DnsBlock::numBlocks) keys_per_block = DnsBlock::numBlocks;
+
+	direct = db->index.isEmpty();
+	buffer.reserve(MAX_DNS_SIZE * 1024);
+}
+
+DNS_DB::BulkLoader::~BulkLoader() {
+	// Remove leftovers if finish() was never called
+	for (unsigned int i = 0; i < runs.size(); i++)
+		unlink(runs[i].c_str());
+}
+
+DNS_DB::queryError DNS_DB::BulkLoader::addDomain(const std::string & domain) {
+	char domint[MAX_DNS_SIZE];
+	if (!domain2idom(domain.c_str(), domint))
+		return resDomainTooLong;
+	return addIDomain(domint);
+}
+
+DNS_DB::queryError DNS_DB::BulkLoader::addIDomain(const char * domint) {
+	buffer.insert(buffer.end(), domint, domint + MAX_DNS_SIZE);
+	if (buffer.size() >= (unsigned long)BULK_RUN_DOMAINS * MAX_DNS_SIZE)
+		spillRun();
+	return resOK;
+}
+
+void DNS_DB::BulkLoader::spillRun() {
+	if (buffer.empty())
+		return;
+
+	RunKey * keys = (RunKey*)&buffer[0];
+	unsigned long n = buffer.size() / MAX_DNS_SIZE;
+	std::sort(keys, keys + n);
+
+	std::string file = db->db_path + "/bulk-run-" + std::to_string(runs.size()) + ".tmp";
+	FILE * fd = fopen(file.c_str(), "wb");
+	if (fd == NULL) {
+		fprintf(stderr, "Could not create run file %s!\n", file.c_str());
+		exit(1);
+	}
+	if (fwrite(keys, sizeof(RunKey), n, fd) != n) {
+		fprintf(stderr, "Could not write run file %s!\n", file.c_str());
+		exit(1);
+	}
+	fclose(fd);
+
+	runs.push_back(file);
+	num_runs++;
+	buffer.clear();
+}
+
+void DNS_DB::BulkLoader::finish() {
+	WriteGuard g(db->dblock);
+	db->startLog();
+	if (runs.empty()) {
+		// Single run: no need to go through the disk
+		RunKey * keys = (RunKey*)(buffer.empty() ? 0 : &buffer[0]);
+		unsigned long n = buffer.size() / MAX_DNS_SIZE;
+		std::sort(keys, keys + n);
+		for (unsigned long i = 0; i < n; i++)
+			emitDomain(keys[i].d);
+		buffer.clear();
+	}
+	else {
+		spillRun();
+
+		std::vector <FILE*> fds;
+		std::vector <char*> iobufs;
+		for (unsigned int i = 0; i < runs.size(); i++) {
+			FILE * fd = fopen(runs[i].c_str(), "rb");
+			assert(fd != NULL);
+			char * iobuf = new char[RUN_IO_BUFFER];
+			setvbuf(fd, iobuf, _IOFBF, RUN_IO_BUFFER);
+			fds.push_back(fd);
+			iobufs.push_back(iobuf);
+		}
+
+		// K-way merge, the heap is a max-heap so reverse the comparison
+		struct RevKey : RunKey {
+			bool operator<(const RevKey & o) const { return greater(d, o.d); }
+		};
+		std::priority_queue < std::pair<RevKey,int> > heap;
+		for (unsigned int i = 0; i < fds.size(); i++) {
+			RevKey k;
+			if (fread(&k, sizeof(RunKey), 1, fds[i]) == 1)
+				heap.push(std::make_pair(k, -(int)i));
+		}
+		while (!heap.empty()) {
+			std::pair<RevKey,int> top = heap.top();
+			heap.pop();
+			emitDomain(top.first.d);
+
+			int r = -top.second;
+			if (fread(&top.first, sizeof(RunKey), 1, fds[r]) == 1)
+				heap.push(top);
+		}
+
+		for (unsigned int i = 0; i < fds.size(); i++) {
+			fclose(fds[i]);
+			delete [] iobufs[i];
+			unlink(runs[i].c_str());
+		}
+		runs.clear();
+	}
+
+	if (direct)
+		emitBlock();
+
+	// Nothing of the above is logged, a crash goes back to the previous
+	// checkpoint
+	db->checkpointFiles();
+	db->updateIterators();
+}
+
+void DNS_DB::BulkLoader::emitDomain(const char * domint) {
+	if (has_last && eq(last, domint)) {
+		num_dups++;
+		return;
+	}
+	memcpy(last, domint, MAX_DNS_SIZE);
+	has_last = true;
+
+	if (!direct) {
+		// Existing data, insert in order (which keeps the working set small)
+		if (db->index.addIDomain(domint) == resOK)
+			num_added++;
+		else
+			num_dups++;
+		return;
+	}
+
+	blkbuf.insert(blkbuf.end(), domint, domint + MAX_DNS_SIZE);
+	num_added++;
+	if (blkbuf.size() >= (unsigned long)keys_per_block * MAX_DNS_SIZE)
+		emitBlock();
+}
+
+void DNS_DB::BulkLoader::emitBlock() {
+	if (blkbuf.empty())
+		return;
+
+	// The first block reuses the (empty) initial node, the rest are appended
+	DnsBlockPtr blk;
+	if (first_block) {
+		blk = db->index.writeBlock(0);
+		first_block = false;
+	}
+	else {
+		blk = db->index.newBlock();
+		db->index.appendBlock(blk->getID(), &blkbuf[0]);
+	}
+
+	unsigned int blkid = blk->getID();
+	unsigned int n = blkbuf.size() / MAX_DNS_SIZE;
+	blk->loadSorted(&blkbuf[0], n);
+	db->index.updateCounts(db->index.getNumNodes()-1, blk);
+	db->ipbloom.clear(blkid);
+	db->dombloom.clear(blkid);
+	for (unsigned int i = 0; i < n; i++)
+		db->dombloom.add(blkid, &blkbuf[i*MAX_DNS_SIZE]);
+	blkbuf.clear();
+}
+
@@ -0,0 +1,264 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <fstream>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "command.h"
+
+/**
+ * Client and load generator for the DB server
+ *
+ *  client host port query domains [connections] [depth] [seconds]
+ *    Runs QueryDomain requests (half of them for the given domains, half
+ *    for domains which should not exist) on each connection, keeping
+ *    depth requests in flight, and reports the throughput
+ *
+ *  client host port scan
+ *    Walks the whole DB with a server side cursor and prints the domains
+ *
+**/
+
+static double now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(const char * host, const char * port) {
+	struct addrinfo hints, * res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return -1;
+
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+static bool send_all(int fd, const std::string & buf) {
+	unsigned long off = 0;
+	while (off < buf.size()) {
+		ssize_t w = write(fd, buf.data() + off, buf.size() - off);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		off += w;
+	}
+	return true;
+}
+
+// Blocking connection that reads replies as they come
+class Connection {
+public:
+	Connection(int fd) : fd(fd), off(0) {}
+	~Connection() { close(fd); }
+
+	bool send(const std::string & buf) { return send_all(fd, buf); }
+
+	bool recv(Reply & r) {
+		while (true) {
+			int n = Reply::decode(in.data() + off, in.size() - off, r);
+			if (n < 0)
+				return false;
+			if (n > 0) {
+				off += n;
+				return true;
+			}
+			in.erase(0, off);
+			off = 0;
+
+			char buf[64*1024];
+			ssize_t got = read(fd, buf, sizeof(buf));
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				return false;
+			in.append(buf, got);
+		}
+	}
+
+private:
+	int fd;
+	std::string in;
+	unsigned long off;
+};
+
+static uint64_t next_rand(uint64_t & s) {
+	s ^= s << 13;
+	s ^= s >> 7;
+	s ^= s << 17;
+	return s;
+}
+
+static int query_load(const char * host, const char * port, const char * file, int nconns, int depth, double seconds) {
+	std::vector <std::string> domains;
+	std::ifstream fin(file);
+	std::string d;
+	while (fin >> d)
+		domains.push_back(d);
+	if (domains.empty()) {
+		fprintf(stderr, "No domains in %s\n", file);
+		return 1;
+	}
+
+	std::atomic <unsigned long> done(0), unexpected(0), failed(0);
+	std::atomic <bool> stop(false);
+	std::vector <std::thread> threads;
+	for (int t = 0; t < nconns; t++) {
+		threads.push_back(std::thread([&, t]() {
+			int fd = connect_to(host, port);
+			if (fd < 0) {
+				failed++;
+				return;
+			}
+			Connection conn(fd);
+			uint64_t s = 0x9e3779b97f4a7c15ULL * (t+1);
+
+			// Requests in flight: whether we expect a hit
+			std::vector <bool> expect;
+			unsigned long head = 0, n = 0, bad = 0;
+			while (!stop) {
+				std::string buf;
+				while (expect.size() - head < (unsigned int)depth) {
+					bool hit = next_rand(s) & 1;
+					const std::string & dom = domains[next_rand(s) % domains.size()];
+					Command::queryDomain(hit ? dom : "zz9-" + dom).encode(buf);
+					expect.push_back(hit);
+				}
+				if (!conn.send(buf))
+					break;
+
+				// Refill once half of the window is answered
+				for (int i = 0; i < (depth+1)/2; i++) {
+					Reply r;
+					if (!conn.recv(r)) {
+						stop = true;
+						break;
+					}
+					if ((r.status == Reply::OK) != expect[head++])
+						bad++;
+					n++;
+				}
+				if (head > 4096) {
+					expect.erase(expect.begin(), expect.begin() + head);
+					head = 0;
+				}
+			}
+			done += n;
+			unexpected += bad;
+		}));
+	}
+
+	double t0 = now_sec();
+	struct timespec ts = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+	nanosleep(&ts, 0);
+	stop = true;
+	for (unsigned int i = 0; i < threads.size(); i++)
+		threads[i].join();
+	double el = now_sec() - t0;
+
+	if (failed)
+		fprintf(stderr, "%lu connections failed\n", (unsigned long)failed);
+	printf("%d connections, depth %d: %lu requests in %.2fs, %.0f requests/s (%lu unexpected replies)\n",
+		nconns, depth, (unsigned long)done, el, done / el, (unsigned long)unexpected);
+	return 0;
+}
+
+// Pipelines (value, next) pairs; after the first End the values repeat the
+// last domain and are ignored
+static int scan(const char * host, const char * port) {
+	int fd = connect_to(host, port);
+	if (fd < 0) {
+		fprintf(stderr, "Could not connect to %s:%s\n", host, port);
+		return 1;
+	}
+	Connection conn(fd);
+
+	std::string buf;
+	Reply r;
+	Command::getIterator().encode(buf);
+	if (!conn.send(buf) || !conn.recv(r))
+		return 1;
+	if (r.status != Reply::OK)
+		return 0;
+	unsigned int it = r.iterator;
+
+	const int batch = 64;
+	bool ended = false;
+	while (!ended) {
+		buf.clear();
+		for (int i = 0; i < batch; i++) {
+			Command::iteratorValue(it).encode(buf);
+			Command::iteratorNext(it).encode(buf);
+		}
+		if (!conn.send(buf))
+			return 1;
+
+		for (int i = 0; i < batch; i++) {
+			Reply v, n;
+			if (!conn.recv(v) || !conn.recv(n))
+				return 1;
+			if (ended)
+				continue;
+			std::cout << v.domain << std::endl;
+			for (unsigned int j = 0; j < v.records.size(); j++)
+				std::cout << v.records[j].ip << " " << v.records[j].first_seen << " " << v.records[j].last_seen << std::endl;
+			if (v.truncated)
+				fprintf(stderr, "Warning: records of %s truncated\n", v.domain.c_str());
+			ended = (n.status != Reply::OK);
+		}
+	}
+
+	buf.clear();
+	Command::closeIterator(it).encode(buf);
+	if (!conn.send(buf) || !conn.recv(r))
+		return 1;
+	return 0;
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s host port command (args...)\n", argv[0]);
+		fprintf(stderr, " Commands:\n");
+		fprintf(stderr, "  * query domains [connections] [depth] [seconds]\n");
+		fprintf(stderr, "  * scan\n");
+		exit(0);
+	}
+
+	std::string command = std::string(argv[3]);
+	if (command == "query" && argc > 4) {
+		return query_load(argv[1], argv[2], argv[4],
+			argc > 5 ? atoi(argv[5]) : 4,
+			argc > 6 ? atoi(argv[6]) : 32,
+			argc > 7 ? atof(argv[7]) : 10);
+	}
+	else if (command == "scan") {
+		return scan(argv[1], argv[2]);
+	}
+	fprintf(stderr, "Unknown command %s\n", command.c_str());
+	return 1;
+}
+
@@ -0,0 +1,128 @@
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+#include "command.h"
+
+/** Wire protocol encoding */
+
+#define FRAME_HEADER   4                  // Length
+#define FRAME_FIXED    (1 + 4 + 1 + 2)    // Type, iterator, domain len, num records
+#define RECORD_SIZE    12
+#define CODE_TRUNCATED 0x80               // Records dropped to fit the frame
+
+static void put8 (std::string & out, uint8_t v)  { out.push_back((char)v); }
+static void put16(std::string & out, uint16_t v) { put8(out, v); put8(out, v >> 8); }
+static void put32(std::string & out, uint32_t v) { put16(out, v); put16(out, v >> 16); }
+
+static uint16_t get16(const unsigned char * p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const unsigned char * p) { return get16(p) | ((uint32_t)get16(p+2) << 16); }
+
+static void encode_frame(std::string & out, uint8_t code, uint32_t it, const std::string & domain, const std::vector <IPv4_Record> & records) {
+	unsigned int dlen = domain.size() > 255 ? 255 : domain.size();
+	unsigned int maxrec = (PROTO_MAX_FRAME - FRAME_FIXED - dlen) / RECORD_SIZE;
+	unsigned int nrec = records.size() > maxrec ? maxrec : records.size();
+	if (nrec < records.size())
+		code |= CODE_TRUNCATED;
+
+	put32(out, FRAME_FIXED + dlen + nrec * RECORD_SIZE);
+	put8 (out, code);
+	put32(out, it);
+	put8 (out, dlen);
+	out.append(domain, 0, dlen);
+	put16(out, nrec);
+	for (unsigned int i = 0; i < nrec; i++) {
+		put32(out, records[i].first_seen);
+		put32(out, records[i].last_seen);
+		put32(out, records[i].ip);
+	}
+}
+
+static int decode_frame(const char * buf, unsigned int len, uint8_t * code, uint32_t * it, std::string & domain, std::vector <IPv4_Record> & records) {
+	const unsigned char * p = (const unsigned char *)buf;
+	if (len < FRAME_HEADER)
+		return 0;
+	uint32_t flen = get32(p);
+	if (flen < FRAME_FIXED || flen > PROTO_MAX_FRAME)
+		return -1;
+	if (len < FRAME_HEADER + flen)
+		return 0;
+
+	p += FRAME_HEADER;
+	const unsigned char * end = p + flen;
+	*code = p[0];
+	*it = get32(p+1);
+	unsigned int dlen = p[5];
+	p += 6;
+	if (p + dlen + 2 > end)
+		return -1;
+	domain.assign((const char *)p, dlen);
+	p += dlen;
+
+	unsigned int nrec = get16(p);
+	p += 2;
+	if (p + nrec * RECORD_SIZE != end)
+		return -1;
+	records.resize(nrec);
+	for (unsigned int i = 0; i < nrec; i++, p += RECORD_SIZE) {
+		records[i].first_seen = get32(p);
+		records[i].last_seen  = get32(p+4);
+		records[i].ip         = get32(p+8);
+	}
+	return FRAME_HEADER + flen;
+}
+
+Command Command::queryDomain(const std::string & domain) { return Command(QueryDomain, 0, domain); }
+Command Command::getIterator(const std::string & domain) { return Command(GetIterator, 0, domain); }
+Command Command::iteratorNext(unsigned int it) { return Command(IteratorNext, it, ""); }
+Command Command::iteratorPrev(unsigned int it) { return Command(IteratorPrev, it, ""); }
+Command Command::iteratorValue(unsigned int it) { return Command(IteratorValue, it, ""); }
+Command Command::addDomain(const std::string & domain) { return Command(AddDomain, 0, domain); }
+Command Command::deleteDomain(const std::string & domain) { return Command(DeleteDomain, 0, domain); }
+Command Command::closeIterator(unsigned int it) { return Command(CloseIterator, it, ""); }
+
+Command Command::updateDomain(const std::string & domain, const std::vector <IPv4_Record> & records) {
+	Command c(UpdateDomain, 0, domain);
+	c.records = records;
+	return c;
+}
+
+void Command::encode(std::string & out) const {
+	encode_frame(out, type, iterator, domain, records);
+}
+
+int Command::decode(const char * buf, unsigned int len, Command & c) {
+	uint8_t code;
+	uint32_t it;
+	int r = decode_frame(buf, len, &code, &it, c.domain, c.records);
+	if (r <= 0)
+		return r;
+	c.truncated = code & CODE_TRUNCATED;
+	code &= ~CODE_TRUNCATED;
+	if (code > CloseIterator)
+		return -1;
+	c.type = (Type)code;
+	c.iterator = it;
+	return r;
+}
+
+void Reply::encode(std::string & out) const {
+	encode_frame(out, status, iterator, domain, records);
+}
+
+int Reply::decode(const char * buf, unsigned int len, Reply & r) {
+	uint8_t code;
+	uint32_t it;
+	int ret = decode_frame(buf, len, &code, &it, r.domain, r.records);
+	if (ret <= 0)
+		return ret;
+	r.truncated = code & CODE_TRUNCATED;
+	code &= ~CODE_TRUNCATED;
+	if (code > Error)
+		return -1;
+	r.status = (Status)code;
+	r.iterator = it;
+	return ret;
+}
+
@@ -2,34 +2,98 @@
 #ifndef COMMAND__H__
 #define COMMAND__H__
 
+#include <string>
+#include <vector>
 #include "record.h"
 
+/**
+ * Wire protocol
+ *
+ * Requests (Command) and responses (Reply) are sent as frames: a 4 byte
+ * length (of the rest of the frame) followed by
+ *
+ *   1 byte   command type / reply status (the top bit is set if records
+ *            were dropped to fit the frame)
+ *   4 bytes  iterator (cursor) ID
+ *   1 byte   domain length, followed by the domain
+ *   2 bytes  number of IPv4 records, followed by the records (12 bytes
+ *            each: first seen, last seen and IP)
+ *
+ * All integers are little endian. Requests can be pipelined, the server
+ * answers them in order. Frames are at most PROTO_MAX_FRAME bytes, which
+ * limits the records to a few thousand per frame.
+ *
+**/
+
+#define PROTO_MAX_FRAME   (64*1024)
+
 class Command {
 public:
-	enum Type { 
+	enum Type {
 		// Read
-		QueryDomain, 
-		GetIterator, 
+		QueryDomain,
+		GetIterator,
 		IteratorNext, IteratorPrev, IteratorValue,
 		// Write
-		AddDomain, DeleteDomain, UpdateDomain
+		AddDomain, DeleteDomain, UpdateDomain,
+		// Release a server side iterator
+		CloseIterator
 	};
 
-	static Command queryDomain();
-	static Command getIterator();
-	static Command iteratorNext();
-	static Command iteratorPrev();
-	static Command iteratorValue();
-	static Command addDomain();
-	static Command deleteDomain();
-	static Command updateDomain();
+	Command() : type(QueryDomain), iterator(0), truncated(false) {}
+
+	static Command queryDomain(const std::string & domain);
+	static Command getIterator(const std::string & domain = "");
+	static Command iteratorNext(unsigned int it);
+	static Command iteratorPrev(unsigned int it);
+	static Command iteratorValue(unsigned int it);
+	static Command addDomain(const std::string & domain);
+	static Command deleteDomain(const std::string & domain);
+	static Command updateDomain(const std::string & domain, const std::vector <IPv4_Record> & records);
+	static Command closeIterator(unsigned int it);
+
+	Type getType() const { return type; }
+	unsigned int getIteratorId() const { return iterator; }
+	const std::string & getDomain() const { return domain; }
+	const std::vector <IPv4_Record> & getRecords() const { return records; }
+	// Some records did not fit in the frame
+	bool isTruncated() const { return truncated; }
+
+	// Appends the frame to out
+	void encode(std::string & out) const;
+	// Returns the frame size, 0 if incomplete or -1 if malformed
+	static int decode(const char * buf, unsigned int len, Command & c);
 
 private:
+	Command(Type t, unsigned int it, const std::string & d) : type(t), iterator(it), truncated(false), domain(d) {}
+
+	Type type;
 	unsigned int iterator;
+	bool truncated;
+
+	std::string domain;
+	std::vector <IPv4_Record> records;
+
+};
+
+class Reply {
+public:
+	enum Status {
+		OK, NotFound, AlreadyExists,
+		End,            // Iterator at the last domain
+		BadRequest, Unsupported, Error
+	};
 
+	Reply(Status s = OK, unsigned int it = 0) : status(s), iterator(it), truncated(false) {}
+
+	Status status;
+	unsigned int iterator;
+	bool truncated;        // Some records did not fit in the frame (decoded only)
 	std::string domain;
 	std::vector <IPv4_Record> records;
 
+	void encode(std::string & out) const;
+	static int decode(const char * buf, unsigned int len, Reply & r);
 };
 
 #endif
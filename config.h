@@ -8,4 +8,76 @@
 #define BlockManager_flush_maximum   (MAX_MEMMAPPED_MEMORY_MB/1)   // Max mem / Block size
 #define BlockManager_flush_trigger   (1.25f*BlockManager_flush_maximum)
 
+// Bulk loader: number of domains per sorted run (35 bytes each) and
+// the fraction of block slots to fill, leaving room for IP records
+#define BULK_RUN_DOMAINS     (4*1024*1024)
+#define BULK_FILL_FACTOR     0.75f
+
+// Ingestion pipeline: input chunk size (bytes), queue depth (chunks or
+// key batches) and number of parsing threads
+#define INGEST_CHUNK_SIZE      (1024*1024)
+#define INGEST_QUEUE_SIZE      8
+#define INGEST_PARSER_THREADS  2
+
+// Max number of pending IP index updates kept in memory before they are
+// merged into the index file
+#define IPINDEX_DELTA_MAX      (256*1024)
+
+// Per block IP Bloom filter size (bytes) and number of hash functions
+#define IPBLOOM_BYTES          1024
+#define IPBLOOM_HASHES         4
+
+// Per block domain Bloom filter size (bytes) and number of hash functions.
+// At 16KB a block with 12K domains has a false positive rate below 1%
+#define DOMBLOOM_BYTES         (16*1024)
+#define DOMBLOOM_HASHES        6
+
+// Block layout (packed memory array): smallest window (slots) rebalanced to
+// make room for an insert, and max density of the whole block (the limit
+// goes down linearly from 1 for the smallest window, per doubling)
+#define PMA_MIN_WINDOW         64
+#define PMA_ROOT_DENSITY       0.9f
+
+// Deletes: a block is compacted once this fraction of its domains are
+// tombstones
+#define COMPACT_TOMBSTONES     0.25f
+
+// Adjacent blocks are merged if their records fit in this fraction of a
+// block (so the result has room left, and does not split right away), and
+// number of index nodes looked at for merges after each delete
+#define MERGE_MAX_FILL         0.5f
+#define MERGE_STEP_NODES       4
+
+// Write-ahead log: records per group commit (the writer filling a group
+// writes it), max time (ms) a record waits for its group, whether commits
+// sync the log, log size (MB) at which the DB files are checkpointed and
+// blocks changed (their pages kept in memory) at which they are too
+#define WAL_GROUP_RECORDS      4096
+#define WAL_GROUP_MS           10
+#define WAL_SYNC               1
+#define WAL_CHECKPOINT_MB      64
+#define CHECKPOINT_BLOCKS      256
+
+// Segment storage: number of blocks per segment file
+#define SEGMENT_BLOCKS         256
+
+// Sharded writer: default number of writer threads, keys per batch and
+// batches queued per writer
+#define WRITER_SHARDS          4
+#define WRITER_BATCH           4096
+#define WRITER_QUEUE_SIZE      4
+
+// Server: default port, listen backlog, events per epoll_wait, read size,
+// max pending output per connection (stops reading from it beyond that),
+// max open cursors per connection and seconds between stats lines
+#define SERVER_PORT            7353
+#define SERVER_BACKLOG         128
+#define SERVER_MAX_EVENTS      256
+#define SERVER_READ_SIZE       (64*1024)
+#define SERVER_MAX_OUTPUT      (1024*1024)
+#define SERVER_MAX_CURSORS     1024
+#define SERVER_STATS_INTERVAL  10
+
+// Page size of the B+tree of index nodes (also its unit in the index file)
+#define INDEX_PAGE_SIZE        4096
 
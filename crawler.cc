@@ -96,6 +96,10 @@ int main(int argc, char ** argv) {
 	ares_destroy(channel);
 	ares_library_cleanup();
 
+	unsigned long lookups, negatives, fps;
+	db->getDomainFilterStats(&lookups, &negatives, &fps);
+	fprintf(stderr, "Domain lookups %lu, %lu answered by the filter, %lu false positives\n", lookups, negatives, fps);
+
 	delete db;
 }
 
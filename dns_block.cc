@@ -7,17 +7,25 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <algorithm>
 #include "dns_db.h"
 
 unsigned char DNS_DB::DnsBlock::flagUsed = 0x80;
 unsigned char DNS_DB::DnsBlock::flagDomain = 0x40;
+unsigned char DNS_DB::DnsBlock::flagDeleted = 0x20;
 unsigned int DNS_DB::DnsBlock::blockSize = (1024*1024);
 unsigned int DNS_DB::DnsBlock::numBlocks = (1024*1024 / 64);
+unsigned int DNS_DB::DnsBlock::trailerSize = 4096;
+unsigned int DNS_DB::DnsBlock::directorySize = (1024*1024 / 64) * sizeof(uint16_t);
+unsigned int DNS_DB::DnsBlock::pageSize = 4096;
 
 #define EMPTY_FOUND     0
 #define NO_EMPTY_SPOT  -1
 #define ALREADY_EXISTS -2
 
+#define TRAILER_MAGIC   0x324d4242   // "BBM2"
+#define TRAILER_BITMAP  64           // Offset of the bitmap in the trailer
+
 
 /** Dns Block */
 
@@ -28,52 +36,257 @@ unsigned int DNS_DB::DnsBlock::numBlocks = (1024*1024 / 64);
 // Domains are sorted in lexicographical order, therefore to do a lookup we can use 
 // dichotomic search on the 4MB block
 // The 1 byte header bits mean:  7: used/not used 6:dns+ips/just ips
+// 5: deleted domain (a tombstone, it and its IP records are dead but keep
+// their slots until the block is compacted)
 // We can extend it to be able to store IPv6 addrs
+// The block is followed by a trailer holding the number of domains and IP
+// records and the occupancy bitmap (one bit per chunk, set if used), which
+// are kept up to date on every change so blocks can be opened without
+// looking at their chunks. Blocks without a trailer (magic) get it rebuilt.
+// SLOT_DIRECTORY builds also keep a slot directory after the trailer: the
+// slots holding domains, in order, so lookups are a binary search on it.
+// Other builds just flag it as stale when they move domains around, and it
+// is rebuilt the next time a SLOT_DIRECTORY build opens the block.
+// Blocks in the last checkpoint are changed through a private view of
+// their mapping (see DNS_DB::makePrivate), so their file is left as it
+// was until the next checkpoint saves the pages that changed.
 
 DNS_DB::DnsBlock::DnsBlock(const std::string & file, int blkid) {
+	// The trailer goes at the end of the file (old files lack it)
+	unsigned int size = blockSize + trailerSize;
+	#ifdef SLOT_DIRECTORY
+	size += directorySize;
+	#endif
 	if (!FileMapper::getInstance().fileExists(file))
-		FileMapper::getInstance().createFile(file, DNS_DB::DnsBlock::blockSize);
+		FileMapper::getInstance().createFile(file, size);
+	else
+		FileMapper::getInstance().extendFile(file, size);
 	
 	void * ptr = FileMapper::getInstance().mapFile(file);
+	#ifdef SLOT_DIRECTORY
+	init(ptr, (char*)ptr + blockSize, (char*)ptr + blockSize + trailerSize, blkid);
+	#else
+	init(ptr, (char*)ptr + blockSize, 0, blkid);
+	#endif
+	this->mapped = true;
+}
+
+// Block living inside a segment, the mapping belongs to the SegmentStore
+DNS_DB::DnsBlock::DnsBlock(void * ptr, void * trailer, void * directory, int blkid) {
+	init(ptr, trailer, directory, blkid);
+	this->mapped = false;
+}
+
+void DNS_DB::DnsBlock::init(void * ptr, void * trailer, void * directory, int blkid) {
+	assert(sizeof(InternalBlock) == 64);
+	assert(TRAILER_BITMAP + numBlocks/8 <= trailerSize);
+	assert(directorySize == numBlocks * sizeof(uint16_t));
 
-	this->blockptr = (InternalBlock *)ptr;
-	this->endptr = &this->blockptr[numBlocks];
 	this->blockid = blkid;
-	this->bitmap.reset(new Bitmap(numBlocks));
+	this->shared[0] = this->shared[1] = this->shared[2] = 0;
+	setView(ptr, trailer, directory);
+
+	if (this->trailer->magic != TRAILER_MAGIC) {
+		updateBM();
+		updateCounts();
+		this->trailer->directory = 0;
+		this->trailer->magic = TRAILER_MAGIC;
+	}
+	if (this->directory && !this->trailer->directory)
+		updateDirectory();
 
-	updateBM();
+	#ifdef EXTRA_CHECK
+	checkBM();
+	#endif
+}
 
-	assert(sizeof(InternalBlock) == 64);
+void DNS_DB::DnsBlock::setView(void * ptr, void * trailer, void * directory) {
+	this->blockptr = (InternalBlock *)ptr;
+	this->endptr = &this->blockptr[numBlocks];
+	this->trailer = (Trailer*)trailer;
+	this->directory = (uint16_t*)directory;
+	this->bitmap.reset(new Bitmap(numBlocks, (char*)trailer + TRAILER_BITMAP));
 }
 
 DNS_DB::DnsBlock::~DnsBlock() {
-	FileMapper::getInstance().unmap(blockptr);
+	// Changes never saved are lost
+	if (isPrivate())
+		setShared(false);
+	if (mapped)
+		FileMapper::getInstance().unmap(blockptr);
 }
 
-DNS_DB::DnsBlock::DnsBlock(const DnsBlockPtr & other) {
+DNS_DB::DnsBlock::DnsBlock(const DnsBlockPtr &) {
 	assert(0 && "This never happens!!\n");
 }
 
+void DNS_DB::DnsBlock::setPrivate(const std::string & file, const unsigned long * offsets) {
+	assert(!isPrivate());
+	FileMapper & fm = FileMapper::getInstance();
+	shared[0] = (char*)blockptr;
+	shared[1] = (char*)trailer;
+	shared[2] = (char*)directory;
+	setView(fm.mapPrivate(file, offsets[0], blockSize), fm.mapPrivate(file, offsets[1], trailerSize),
+		directory ? fm.mapPrivate(file, offsets[2], directorySize) : 0);
+}
+
+void DNS_DB::DnsBlock::setShared(bool keep) {
+	assert(isPrivate());
+	if (keep)
+		diffPages([](char * page, char * file, unsigned int) { memcpy(file, page, pageSize); });
+
+	FileMapper & fm = FileMapper::getInstance();
+	fm.unmapPrivate(blockptr, blockSize);
+	fm.unmapPrivate(trailer, trailerSize);
+	if (directory)
+		fm.unmapPrivate(directory, directorySize);
+	setView(shared[0], shared[1], shared[2]);
+	shared[0] = shared[1] = shared[2] = 0;
+}
+
+// The pages of the private view which differ from the file, with their
+// offsets in the layout of a block file (block, trailer, directory)
+void DNS_DB::DnsBlock::scanChanges(const std::function<void(unsigned int offset, const char * page)> & cb) const {
+	diffPages([&cb](char * page, char *, unsigned int offset) { cb(offset, page); });
+}
+
+void DNS_DB::DnsBlock::diffPages(const std::function<void(char * page, char * file, unsigned int offset)> & cb) const {
+	char * view[3] = { (char*)blockptr, (char*)trailer, (char*)directory };
+	unsigned int size[3] = { blockSize, trailerSize, directorySize };
+	unsigned int base = 0;
+	for (int r = 0; r < 3; r++) {
+		for (unsigned int off = 0; view[r] && off < size[r]; off += pageSize)
+			if (memcmp(view[r] + off, shared[r] + off, pageSize) != 0)
+				cb(view[r] + off, shared[r] + off, base + off);
+		base += size[r];
+	}
+}
+
 void DNS_DB::DnsBlock::updateBM() {
 	for (unsigned int i = 0; i < numBlocks; i++)
 		bitmap->setBit(i, (blockptr[i].header & flagUsed) != 0);
 }
 
+// Adds the domains and IPs in a chunk to the counters. Chunks must be
+// counted in order, dead tells whether the last domain was deleted
+void DNS_DB::DnsBlock::countChunk(const InternalBlock * ptr, bool * dead, uint32_t * domains, uint32_t * ips, uint32_t * deleted) {
+	if (!(ptr->header & flagUsed))
+		return;
+	if (ptr->header & flagDomain) {
+		*dead = (ptr->header & flagDeleted) != 0;
+		if (*dead) {
+			(*deleted)++;
+			return;
+		}
+		(*domains)++;
+		for (int i = 0; i < 2; i++)
+			*ips += (ptr->data.domain.records[i].ip != 0);
+	}
+	else if (!*dead) {
+		for (int i = 0; i < 5; i++)
+			*ips += (ptr->data.records.records[i].ip != 0);
+	}
+}
+
+void DNS_DB::DnsBlock::updateCounts() {
+	bool dead = false;
+	trailer->domains = trailer->ips = trailer->deleted = 0;
+	for (unsigned int i = 0; i < numBlocks; i++)
+		countChunk(&blockptr[i], &dead, &trailer->domains, &trailer->ips, &trailer->deleted);
+}
+
+// Fixes the bitmap and the counters if they do not match the slots (the
+// block was being written when the DB crashed), returns whether they did not
+bool DNS_DB::DnsBlock::recount() {
+	uint32_t domains = 0, ips = 0, deleted = 0;
+	bool dead = false, bad = false;
+	for (unsigned int i = 0; i < numBlocks; i++) {
+		countChunk(&blockptr[i], &dead, &domains, &ips, &deleted);
+		bool used = (blockptr[i].header & flagUsed) != 0;
+		if (bitmap->getBit(i) != used) {
+			bitmap->setBit(i, used);
+			bad = true;
+		}
+	}
+	if (domains != trailer->domains || ips != trailer->ips || deleted != trailer->deleted) {
+		trailer->domains = domains;
+		trailer->ips = ips;
+		trailer->deleted = deleted;
+		bad = true;
+	}
+	return bad;
+}
+
 void DNS_DB::DnsBlock::checkBM() {
 	for (unsigned int i = 0; i < numBlocks; i++)
 		assert( bitmap->getBit(i) == ((blockptr[i].header & flagUsed) != 0) );
+
+	if (directory) {
+		unsigned int n = 0;
+		for (unsigned int i = 0; i < numBlocks; i++)
+			if ((blockptr[i].header & flagUsed) && (blockptr[i].header & flagDomain))
+				assert(n < dirSize() && directory[n++] == i);
+		assert(n == dirSize() && trailer->directory);
+		(void)n;
+	}
+}
+
+void DNS_DB::DnsBlock::updateDirectory() {
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < numBlocks; i++)
+		if ((blockptr[i].header & flagUsed) && (blockptr[i].header & flagDomain))
+			directory[n++] = i;
+	assert(n == dirSize());
+	trailer->directory = 1;
+}
+
+// A domain was placed at slot (call before counting it)
+void DNS_DB::DnsBlock::dirInsert(int slot) {
+	if (!directory) {
+		trailer->directory = 0;
+		return;
+	}
+	uint16_t * end = directory + dirSize();
+	uint16_t * it = std::lower_bound(directory, end, (uint16_t)slot);
+	memmove(it + 1, it, (end - it) * sizeof(uint16_t));
+	*it = slot;
+}
+
+// The domains in [ws, we) moved around (but stayed inside)
+void DNS_DB::DnsBlock::dirWindow(int ws, int we) {
+	if (!directory) {
+		trailer->directory = 0;
+		return;
+	}
+	uint16_t * it = std::lower_bound(directory, directory + dirSize(), (uint16_t)ws);
+	for (int i = ws; i < we; i++)
+		if ((blockptr[i].header & flagUsed) && (blockptr[i].header & flagDomain))
+			*it++ = i;
+}
+
+// The slots from pos on moved to the start of newblk (call before the counts change)
+void DNS_DB::DnsBlock::dirSplit(int pos, DnsBlock * newblk) {
+	if (!directory || !newblk->directory) {
+		trailer->directory = newblk->trailer->directory = 0;
+		return;
+	}
+	uint16_t * end = directory + dirSize();
+	uint16_t * it = std::lower_bound(directory, end, (uint16_t)pos);
+	for (uint16_t * d = newblk->directory; it != end; it++, d++)
+		*d = *it - pos;
+	newblk->trailer->directory = 1;
 }
 
 DNS_DB::DnsBlock::InternalBlock * DNS_DB::DnsBlock::lookupDomain(const char * domain) const {
 	// Pick the specified element
 	int p;
 	int res = lookupEmptyDomainSpot(domain, &p);
-	if (res != ALREADY_EXISTS || p < 0 || p >= numBlocks) return 0;
+	if (res != ALREADY_EXISTS || p < 0 || p >= numBlocks || !isLive(p)) return 0;
 
 	DNS_DB::DnsBlock::InternalBlock * ptr = &blockptr[p];
 
 	assert(ptr->header & flagDomain);
-	assert(memcmp(domain, ptr->data.domain.domain, MAX_DNS_SIZE) == 0);
+	assert(eq(domain, ptr->data.domain.domain));
 	
 	return ptr;
 }
@@ -105,14 +318,83 @@ std::vector <IPv4_Record> DNS_DB::DnsBlock::getIpsv4(int p) const {
 	return ret;
 }
 
+std::vector <IPv4_Record> DNS_DB::DnsBlock::getDomainIpsv4(const char * domint) const {
+	int p;
+	if (lookupEmptyDomainSpot(domint, &p) != ALREADY_EXISTS || !isLive(p))
+		return std::vector <IPv4_Record>();
+	return getIpsv4(p);
+}
+
+// Calls cb for every IP record in the block (along with its domain),
+// skipping the deleted domains
+void DNS_DB::DnsBlock::scanIpsv4(const IpCallback & cb) const {
+	const char * domint = 0;
+	for (unsigned int i = 0; i < numBlocks; i++) {
+		const DNS_DB::DnsBlock::InternalBlock * ptr = &blockptr[i];
+		if (!(ptr->header & flagUsed))
+			continue;
+
+		if (ptr->header & flagDomain) {
+			domint = (ptr->header & flagDeleted) ? 0 : ptr->data.domain.domain;
+			for (int j = 0; domint && j < 2; j++)
+				if (ptr->data.domain.records[j].ip != 0)
+					cb(domint, ptr->data.domain.records[j]);
+		}
+		else if (domint) {
+			for (int j = 0; j < 5; j++)
+				if (ptr->data.records.records[j].ip != 0)
+					cb(domint, ptr->data.records.records[j]);
+		}
+	}
+}
+
+void DNS_DB::DnsBlock::scanDomains(const DomainCallback & cb) const {
+	for (unsigned int i = 0; i < numBlocks; i++) {
+		if (isLive(i))
+			cb(blockptr[i].data.domain.domain);
+	}
+}
+
 bool DNS_DB::DnsBlock::hasDomain(const char * domint) const {
-	return lookupEmptyDomainSpot(domint,0) == ALREADY_EXISTS;
+	int p;
+	return lookupEmptyDomainSpot(domint, &p) == ALREADY_EXISTS && isLive(p);
+}
+
+// Binary search on the slot directory. Same results as the scans below:
+// the slot when the domain exists, otherwise the first free slot after
+// the previous domain (and its IP records) or the next domain if none
+int DNS_DB::DnsBlock::lookupDirectory(const char * domain, int * pos) const {
+	int first = 0, last = dirSize();
+	while (first < last) {
+		int middle = (first+last)>>1;
+		if ( less(blockptr[directory[middle]].data.domain.domain, domain) )
+			first = middle+1;
+		else
+			last = middle;
+	}
+
+	int next = first < (int)dirSize() ? directory[first] : numBlocks;
+	if (next < numBlocks && eq(blockptr[next].data.domain.domain, domain)) {
+		if (pos) *pos = next;
+		return ALREADY_EXISTS;
+	}
+
+	int p = first > 0 ? directory[first-1]+1 : 0;
+	while (p < next && (blockptr[p].header & flagUsed))
+		p++;
+	if (pos) *pos = p;
+	return p < next ? EMPTY_FOUND : NO_EMPTY_SPOT;
 }
 
 int DNS_DB::DnsBlock::lookupEmptyDomainSpot(const char * domain, int * pos) const {
 	DNS_DB::DnsBlock::InternalBlock * ptr = blockptr;
 	int last_empty = NO_EMPTY_SPOT;
 
+	#ifdef SLOT_DIRECTORY
+	if (directory)
+		return lookupDirectory(domain, pos);
+	#endif
+
 	#ifdef FAST_SEARCH
 	int first = 0, last = numBlocks-1;
 	while (first != last) {
@@ -214,7 +496,7 @@ int DNS_DB::DnsBlock::lookupEmptyDomainSpot(const char * domain, int * pos) cons
 			}
 			else {
 				// Found a domain which is bigger than us
-				if (memcmp(domain, ptr->data.domain.domain, MAX_DNS_SIZE) == 0) {
+				if (eq(domain, ptr->data.domain.domain)) {
 					if (pos) *pos = i;
 					return ALREADY_EXISTS;
 				}
@@ -248,8 +530,22 @@ DNS_DB::queryError DNS_DB::DnsBlock::addDomain(const char * domint) {
 		if (res == NO_EMPTY_SPOT)
 			return resNoSpaceLeft;
 	}
-	else if (res == ALREADY_EXISTS)
-		return resAlreadyExists;
+	else if (res == ALREADY_EXISTS) {
+		if (isLive(spot))
+			return resAlreadyExists;
+
+		// Revive the tombstone, without its old IP records
+		DNS_DB::DnsBlock::InternalBlock * place = &blockptr[spot];
+		place->header &= ~flagDeleted;
+		memset(place->data.domain.records, 0, sizeof(place->data.domain.records));
+		for (int i = spot+1; i < numBlocks && (blockptr[i].header & flagUsed) && !(blockptr[i].header & flagDomain); i++) {
+			memset(&blockptr[i], 0, sizeof(InternalBlock));
+			bitmap->setBit(i, false);
+		}
+		trailer->deleted--;
+		trailer->domains++;
+		return resOK;
+	}
 
 	DNS_DB::DnsBlock::InternalBlock * place = &blockptr[spot];
 	assert((!(place->header & DNS_DB::DnsBlock::flagUsed) && !(place->header & DNS_DB::DnsBlock::flagDomain)));
@@ -259,6 +555,8 @@ DNS_DB::queryError DNS_DB::DnsBlock::addDomain(const char * domint) {
 	place->header = DNS_DB::DnsBlock::flagUsed | DNS_DB::DnsBlock::flagDomain;
 	memcpy(place->data.domain.domain, domint, MAX_DNS_SIZE);
 	bitmap->setBit(spot,true);
+	dirInsert(spot);
+	trailer->domains++;
 
 	#ifdef EXTRA_CHECK
 	checkBM();
@@ -277,6 +575,7 @@ bool DNS_DB::DnsBlock::replaceDomainIpv4(const char * domint, const IPv4_Record
 			for (int i = 0; i < 2; i++)
 				if (ptr->data.domain.records[i] == oldrec) {
 					ptr->data.domain.records[i] = newrec;
+					trailer->ips += (newrec.ip != 0) - (oldrec.ip != 0);
 					return true;
 				}
 		}
@@ -284,6 +583,7 @@ bool DNS_DB::DnsBlock::replaceDomainIpv4(const char * domint, const IPv4_Record
 			for (int i = 0; i < 5; i++)
 				if (ptr->data.records.records[i] == oldrec) {
 					ptr->data.records.records[i] = newrec;
+					trailer->ips += (newrec.ip != 0) - (oldrec.ip != 0);
 					return true;
 				}
 		}
@@ -294,6 +594,83 @@ bool DNS_DB::DnsBlock::replaceDomainIpv4(const char * domint, const IPv4_Record
 	return false;
 }
 
+// Tombstones a domain: it keeps its slots (and IP records) until the block
+// is compacted. Returns its IPs so they can be unindexed
+bool DNS_DB::DnsBlock::deleteDomain(const char * domint, std::vector <IPv4_Record> * ips) {
+	DNS_DB::DnsBlock::InternalBlock * ptr = lookupDomain(domint);
+	if (ptr == 0)
+		return false;
+
+	std::vector <IPv4_Record> recs = getIpsv4(ptr - blockptr);
+	ptr->header |= flagDeleted;
+	trailer->domains--;
+	trailer->deleted++;
+	trailer->ips -= recs.size();
+	if (ips)
+		ips->swap(recs);
+	return true;
+}
+
+// Frees the tombstones (along with their IP records) and the IP record
+// chunks left empty by repacking the records of each domain. Domains stay
+// where they are, the freed slots are gaps for the next inserts. Returns
+// the number of slots freed
+int DNS_DB::DnsBlock::compact() {
+	int freed = 0;
+	bool moved = trailer->deleted > 0;
+	for (int i = 0; i < numBlocks; ) {
+		if (!(blockptr[i].header & flagUsed) || !(blockptr[i].header & flagDomain)) {
+			i++;
+			continue;
+		}
+		// The domain and its IP records take [i, e)
+		int e = i+1;
+		while (e < numBlocks && (blockptr[e].header & flagUsed) && !(blockptr[e].header & flagDomain))
+			e++;
+
+		int keep = 0;
+		if (isLive(i)) {
+			std::vector <IPv4_Record> recs = getIpsv4(i);
+			keep = 1 + (recs.size() > 2 ? (recs.size() - 2 + 4) / 5 : 0);
+			if (keep < e - i) {
+				memset(blockptr[i].data.domain.records, 0, sizeof(blockptr[i].data.domain.records));
+				memset(&blockptr[i+1], 0, sizeof(InternalBlock) * (keep-1));
+				for (unsigned int j = 0; j < recs.size(); j++) {
+					if (j < 2)
+						blockptr[i].data.domain.records[j] = recs[j];
+					else {
+						InternalBlock * ptr = &blockptr[i + 1 + (j-2) / 5];
+						ptr->header = flagUsed;
+						ptr->data.records.records[(j-2) % 5] = recs[j];
+					}
+				}
+			}
+			else
+				keep = e - i;
+		}
+		for (int j = i + keep; j < e; j++) {
+			memset(&blockptr[j], 0, sizeof(InternalBlock));
+			bitmap->setBit(j, false);
+		}
+		freed += e - i - keep;
+		i = e;
+	}
+	trailer->deleted = 0;
+
+	// Only the tombstones change the domain slots
+	if (moved) {
+		if (directory)
+			updateDirectory();
+		else
+			trailer->directory = 0;
+	}
+
+	#ifdef EXTRA_CHECK
+	checkBM();
+	#endif
+	return freed;
+}
+
 bool DNS_DB::DnsBlock::addDomainIpv4(const char * domint, const IPv4_Record & iprec) {
 	return addDomainIpv4_int(domint, iprec, true);
 }
@@ -309,6 +686,7 @@ bool DNS_DB::DnsBlock::addDomainIpv4_int(const char * domint, const IPv4_Record
 			for (int i = 0; i < 2; i++)
 				if (ptr->data.domain.records[i].ip == 0) {
 					ptr->data.domain.records[i] = iprec;
+					trailer->ips++;
 					return true;
 				}
 		}
@@ -316,6 +694,7 @@ bool DNS_DB::DnsBlock::addDomainIpv4_int(const char * domint, const IPv4_Record
 			for (int i = 0; i < 5; i++)
 				if (ptr->data.records.records[i].ip == 0) {
 					ptr->data.records.records[i] = iprec;
+					trailer->ips++;
 					return true;
 				}
 		}
@@ -329,7 +708,8 @@ bool DNS_DB::DnsBlock::addDomainIpv4_int(const char * domint, const IPv4_Record
 		memset(ptr, 0, sizeof(InternalBlock));
 		ptr->header = DNS_DB::DnsBlock::flagUsed;
 		ptr->data.records.records[0] = iprec;
-		updateBM(); // FIXME do this with bit set!
+		bitmap->setBit(ptr - blockptr, true);
+		trailer->ips++;
 		return true;
 	}
 	else if (ret) {
@@ -341,77 +721,177 @@ bool DNS_DB::DnsBlock::addDomainIpv4_int(const char * domint, const IPv4_Record
 	return false;
 }
 
-// Tries to move some records down and make room for our domain
-// TODO in order to support deleting registers we should tightly 
-// pack the registers at some point, so we can recover space before
+// Makes room for a new domain, or an IP record of an existing one: a free
+// slot right after the last domain <= domain (and its IP records).
+// The block is a packed memory array: find the smallest window around that
+// point (PMA_MIN_WINDOW slots, doubling up to the whole block) whose
+// density stays below its limit with one more record, and spread the
+// records in it evenly, with the free slot where it is needed. Each insert
+// then moves a bounded number of slots, and the gaps stay evenly spread
+// so the next inserts nearby find room. If even the whole block is too
+// dense nothing is done, and the block gets split.
 void DNS_DB::DnsBlock::makeRoomMove(const char * domain) {
-	// Assume we do not have an empty spot for ourselves. Therefore
-	// look for the place we should be and move all the nodes down one
-	// position
 	int p = 0;
-
 	int res = lookupEmptyDomainSpot(domain, &p);
 	assert(res == NO_EMPTY_SPOT || res == ALREADY_EXISTS);
 
-	for (p; p < numBlocks; p++) {
-		DNS_DB::DnsBlock::InternalBlock * ptr = &blockptr[p];
-		// Stop after we find our spot
-		if ((ptr->header & flagUsed) && (ptr->header & DNS_DB::DnsBlock::flagDomain)) {
-			if ( !less(ptr->data.domain.domain, domain) ) {
-				// If the domain exists move to the last block of it
-				if (memcmp(ptr->data.domain.domain, domain, MAX_DNS_SIZE) == 0) {
-					do {
-						p++;
-						ptr = &blockptr[p];
-					} while (ptr != endptr && (ptr->header & DNS_DB::DnsBlock::flagUsed) && !(ptr->header & DNS_DB::DnsBlock::flagDomain));
-				}
+	int at = p;
+	if (res == NO_EMPTY_SPOT) {
+		// p is close (before) the next domain, depending on the search
+		for (; p < numBlocks; p++)
+			if ((blockptr[p].header & flagUsed) && (blockptr[p].header & flagDomain) && greater(blockptr[p].data.domain.domain, domain))
 				break;
-			}
-		}
+		// There is no free slot in between, only the previous one's IP records
+		for (at = p-1; at >= 0 && !(blockptr[at].header & flagDomain); at--)
+			assert(blockptr[at].header & flagUsed);
 	}
 
-	// We should not have space after us, otherwise why are we getting called?
-	assert((p == numBlocks) || (blockptr[p].header & DNS_DB::DnsBlock::flagDomain));
+	int levels = 0;
+	while ((PMA_MIN_WINDOW << levels) < numBlocks)
+		levels++;
 
-	if (p == numBlocks)
-		return;
+	int c = at >= 0 ? at : 0;
+	for (int l = 0; l <= levels; l++) {
+		int w = PMA_MIN_WINDOW << l;
+		int ws = c & ~(w-1), we = std::min(ws + w, (int)numBlocks);
+
+		// Do not cut a domain from its IP records
+		while (ws > 0 && (blockptr[ws].header & flagUsed) && !(blockptr[ws].header & flagDomain))
+			ws--;
+		while (we < numBlocks && (blockptr[we].header & flagUsed) && !(blockptr[we].header & flagDomain))
+			we++;
+
+		float density = 1.0f - (1.0f - PMA_ROOT_DENSITY) * l / levels;
+		if (bitmap->countRange(ws, we) + 1 <= density * (we - ws)) {
+			rebalance(ws, we, at);
+			return;
+		}
+	}
+}
 
+// Spreads the records in [ws, we) evenly, leaving a free slot right after
+// the domain at slot at and its IP records (at the start if at < 0)
+void DNS_DB::DnsBlock::rebalance(int ws, int we, int at) {
 	#ifdef EXTRA_CHECK
 	checkBM();
 	#endif
 
-	// Look for the first empty slot, and move the N slots to make room
-	int tomove = 1;
-	InternalBlock * ptrl = &blockptr[p+1];
-	while (ptrl != endptr) {
-		if (!(ptrl->header & flagUsed)) {
-			// Move N consec elements down, to make room at ptr
-			memmove(&blockptr[p+1], &blockptr[p], tomove*sizeof(InternalBlock));
-			memset (&blockptr[p], 0, sizeof(InternalBlock));
-			break;
+	// Runs of used slots (a domain and its IP records), the free slot is
+	// an empty run of size 1
+	std::vector < std::pair<int,int> > runs;   // Start slot, size
+	bool pending = at >= ws;
+	if (!pending)
+		runs.push_back(std::make_pair(-1, 1));
+	for (int i = ws; i < we; i++) {
+		if (!(blockptr[i].header & flagUsed))
+			continue;
+		if (i == ws || (blockptr[i].header & flagDomain) || !(blockptr[i-1].header & flagUsed)) {
+			if (pending && i > at) {
+				runs.push_back(std::make_pair(-1, 1));
+				pending = false;
+			}
+			runs.push_back(std::make_pair(i, 0));
 		}
-		else
-			tomove++;
-			
-		ptrl++;
+		runs.back().second++;
 	}
-	
-	if (ptrl == endptr)
-		return;
+	if (pending)
+		runs.push_back(std::make_pair(-1, 1));
 
-	// Update the bitmask
-	bitmap->setBit(p+tomove, true);
-	bitmap->setBit(p, false);
+	layoutRuns(ws, we, runs);
+	dirWindow(ws, we);
 
 	#ifdef EXTRA_CHECK
 	checkBM();
 	#endif
+}
+
+// Moves the runs (start slot, size; empty ones if the start is < 0) in
+// [ws, we), with the free slots spread as evenly as possible between them.
+// The runs are in order and start in this block, or in from at (start -
+// numBlocks) for the ones after all the local ones. Records are moved in
+// place like memmove does (left shifts first, going up, then right shifts,
+// going down), so there is always a copy of each record in the block, even
+// if the process dies halfway
+void DNS_DB::DnsBlock::layoutRuns(int ws, int we, const std::vector < std::pair<int,int> > & runs, const InternalBlock * from) {
+	unsigned int m = runs.size(), size = 0;
+	for (unsigned int i = 0; i < m; i++)
+		size += runs[i].second;
+	assert(size <= (unsigned int)(we - ws));
+
+	// Gaps after every run
+	std::vector <int> dest(m);
+	unsigned int freeslots = (we - ws) - size;
+	int pos = ws;
+	for (unsigned int i = 0; i < m; i++) {
+		dest[i] = pos;
+		pos += runs[i].second + (unsigned long)(i+1) * freeslots / m - (unsigned long)i * freeslots / m;
+	}
+	assert(m == 0 || pos == we);
+
+	for (unsigned int i = 0; i < m; i++)
+		if (runs[i].first >= 0 && runs[i].first < (int)numBlocks && dest[i] < runs[i].first)
+			memmove(&blockptr[dest[i]], &blockptr[runs[i].first], sizeof(InternalBlock) * runs[i].second);
+	for (int i = m - 1; i >= 0; i--)
+		if (runs[i].first >= 0 && runs[i].first < (int)numBlocks && dest[i] > runs[i].first)
+			memmove(&blockptr[dest[i]], &blockptr[runs[i].first], sizeof(InternalBlock) * runs[i].second);
+	for (unsigned int i = 0; i < m; i++)
+		if (runs[i].first >= (int)numBlocks) {
+			assert(from);
+			memcpy(&blockptr[dest[i]], &from[runs[i].first - numBlocks], sizeof(InternalBlock) * runs[i].second);
+		}
+
+	// The rest is free now (stale copies of the moved records)
+	pos = ws;
+	for (unsigned int i = 0; i <= m; i++) {
+		int used = i < m && runs[i].first >= 0 ? runs[i].second : 0;
+		int end = i < m ? dest[i] : we;
+		if (end > pos)
+			memset(&blockptr[pos], 0, sizeof(InternalBlock) * (end - pos));
+		for (int j = pos; j < end; j++)
+			bitmap->setBit(j, false);
+		for (int j = 0; j < used; j++)
+			bitmap->setBit(end + j, true);
+		pos = end + used;
+	}
+}
+
+// Copies all the records of next (whose domains sort after ours) to this
+// block, spreading them evenly. Both must fit, next is not modified (it
+// might still be needed by the last checkpoint, see wal.cc)
+void DNS_DB::DnsBlock::mergeBlock(const DnsBlock * next) {
+	assert(getNumRecords() + next->getNumRecords() <= (int)numBlocks);
+
+	// Runs of next start at numBlocks (see layoutRuns)
+	std::vector < std::pair<int,int> > runs;   // Start slot, size
+	const DnsBlock * blks[2] = { this, next };
+	for (int b = 0; b < 2; b++) {
+		const InternalBlock * ptr = blks[b]->blockptr;
+		for (int i = 0; i < numBlocks; i++) {
+			if (!(ptr[i].header & flagUsed))
+				continue;
+			if (i == 0 || (ptr[i].header & flagDomain) || !(ptr[i-1].header & flagUsed))
+				runs.push_back(std::make_pair(i + b * (int)numBlocks, 0));
+			runs.back().second++;
+		}
+	}
+
+	layoutRuns(0, numBlocks, runs, next->blockptr);
+	trailer->domains += next->trailer->domains;
+	trailer->ips += next->trailer->ips;
+	trailer->deleted += next->trailer->deleted;
 
-	// It might happen that we do not have room :(
+	if (directory)
+		updateDirectory();
+	else
+		trailer->directory = 0;
+
+	#ifdef EXTRA_CHECK
+	checkBM();
+	#endif
 }
 
-// Create a new DnsBlock and move some registers there using domint as hint
-void DNS_DB::DnsBlock::splitBlock(const char * domint, DNS_DB::DnsBlockPtr & newblk) {
+// Create a new DnsBlock and move some registers there
+void DNS_DB::DnsBlock::splitBlock(DNS_DB::DnsBlockPtr & newblk) {
 	int pos = -1;
 	// Just split in 1/16 chunks, to minimize spill
 	for (int start = 8*numBlocks/16; start >= 0; start -= numBlocks/16) {
@@ -429,12 +909,52 @@ void DNS_DB::DnsBlock::splitBlock(const char * domint, DNS_DB::DnsBlockPtr & new
 
 	// Just memcpy the regs after and then zero the old ones
 	int regs_after  = numBlocks - pos;
+	dirSplit(pos, newblk.get());
 	
 	memcpy(newblk->blockptr, &this->blockptr[pos], sizeof(InternalBlock)*regs_after);
 	memset(&this->blockptr[pos], 0, sizeof(InternalBlock)*regs_after);
 
-	this->updateBM();
-	newblk->updateBM();
+	// The new block is empty, move the bits and the counts along
+	uint32_t domains = 0, ips = 0, deleted = 0;
+	bool dead = false;
+	for (unsigned int i = pos; i < numBlocks; i++) {
+		newblk->bitmap->setBit(i - pos, bitmap->getBit(i));
+		bitmap->setBit(i, false);
+		countChunk(&newblk->blockptr[i - pos], &dead, &domains, &ips, &deleted);
+	}
+	assert(newblk->trailer->domains == 0 && newblk->trailer->ips == 0 && newblk->trailer->deleted == 0);
+	newblk->trailer->domains = domains;
+	newblk->trailer->ips = ips;
+	newblk->trailer->deleted = deleted;
+	trailer->domains -= domains;
+	trailer->ips -= ips;
+	trailer->deleted -= deleted;
+
+	#ifdef EXTRA_CHECK
+	checkBM();
+	newblk->checkBM();
+	#endif
+}
+
+// Fills an empty block with n sorted domains, spreading them evenly so
+// there is room for IP records and later inserts next to each domain
+void DNS_DB::DnsBlock::loadSorted(const char * domints, int n) {
+	assert(n > 0 && n <= numBlocks);
+	assert(bitmap->bitCount() == 0);
+
+	memset(blockptr, 0, sizeof(InternalBlock)*numBlocks);
+	for (int i = 0; i < n; i++) {
+		DNS_DB::DnsBlock::InternalBlock * ptr = &blockptr[(unsigned long)i * numBlocks / n];
+		ptr->header = flagUsed | flagDomain;
+		memcpy(ptr->data.domain.domain, &domints[i*MAX_DNS_SIZE], MAX_DNS_SIZE);
+		bitmap->setBit(ptr - blockptr, true);
+		if (directory)
+			directory[i] = ptr - blockptr;
+	}
+	trailer->domains = n;
+	trailer->ips = 0;
+	trailer->deleted = 0;
+	trailer->directory = (directory != 0);
 }
 
 void DNS_DB::DnsBlock::getMaxDomain(char *d) const {
@@ -476,52 +996,63 @@ void DNS_DB::DnsBlock::check() const {
 		last_empty = ((blockptr[i].header & flagUsed) == 0);
 	}
 
-	
-	
+	// And the trailer
+	uint32_t domains = 0, ips = 0, deleted = 0;
+	int used = 0;
+	bool dead = false;
+	for (unsigned int i = 0; i < numBlocks; i++) {
+		countChunk(&blockptr[i], &dead, &domains, &ips, &deleted);
+		used += (blockptr[i].header & flagUsed) != 0;
+	}
+	if (domains != trailer->domains || ips != trailer->ips || deleted != trailer->deleted || used != bitmap->bitCount())
+		fprintf(stderr, "Error in block %d, bad counters!\n", blockid);
+
+	if (directory && trailer->directory) {
+		unsigned int n = 0, bad = 0;
+		for (unsigned int i = 0; i < numBlocks; i++)
+			if ((blockptr[i].header & flagUsed) && (blockptr[i].header & flagDomain))
+				bad += (n >= dirSize() || directory[n++] != i);
+		if (bad || n != dirSize())
+			fprintf(stderr, "Error in block %d, bad slot directory!\n", blockid);
+	}
 }
 
 
 
 /** Iterator stuff */
 
-// Iterator for DnsBlock: Goto the first domain (or to the end, if no domains at all!)
+// Iterator for DnsBlock: Goto the first live domain from domint (or to
+// the end, if there are none)
 DNS_DB::DnsBlock::Iterator::Iterator (int blkid, const char * domint, DNS_DB * dbref) : block_id(blkid), db(dbref) {
 	DnsBlockPtr block = db->getBlock(blkid);
 
+	p = 0;
 	if (domint) {
-		int r = block->lookupEmptyDomainSpot(domint, &p);
-		assert(r == ALREADY_EXISTS);
+		// The lookup only gives a hint if the domain is gone (deleted or
+		// compacted while iterating), look for the next one from there
+		block->lookupEmptyDomainSpot(domint, &p);
+		while (p < numBlocks && !( (block->blockptr[p].header & flagUsed) && (block->blockptr[p].header & flagDomain) &&
+			greater_eq(block->blockptr[p].data.domain.domain, domint) ))
+			p++;
 	}
-	else
-		p = 0;
-
-	while (&block->blockptr[p] != block->endptr && 
-		!( (block->blockptr[p].header & flagDomain) && (block->blockptr[p].header & flagUsed)) ) {
 
+	while (p < numBlocks && !block->isLive(p))
 		p++;
-	}
-
-	assert(p >= 0 && p < numBlocks);
-	assert(block->blockptr[p].header & flagDomain);
 }
 
 void DNS_DB::DnsBlock::Iterator::next() {
 	DnsBlockPtr block = db->getBlock(block_id);
 	do {
 		p++;
-	} while (&block->blockptr[p] != block->endptr && 
-		!( (block->blockptr[p].header & flagDomain) && (block->blockptr[p].header & flagUsed) ));
+	} while (p < numBlocks && !block->isLive(p));
 }
 
 bool DNS_DB::DnsBlock::Iterator::end() const {
 	DnsBlockPtr block = db->getBlock(block_id);
-	int i = p;
-	do {
-		i++;
-	} while (&block->blockptr[i] != block->endptr && 
-		!( (block->blockptr[i].header & flagDomain) && (block->blockptr[i].header & flagUsed) ));
-
-	return &block->blockptr[i] == block->endptr;
+	for (int i = p+1; i < numBlocks; i++)
+		if (block->isLive(i))
+			return false;
+	return true;
 }
 
 std::string DNS_DB::DnsBlock::Iterator::getDomain() {
@@ -535,7 +1066,7 @@ std::string DNS_DB::DnsBlock::Iterator::getDomain() {
 void DNS_DB::DnsBlock::Iterator::getDomain(char * dom) {
 	DnsBlockPtr block = db->getBlock(block_id);
 	assert(p >= 0 && p < numBlocks);
-	assert(block->blockptr[p].header & flagDomain);
+	assert(block->isLive(p));
 	memcpy(dom, block->blockptr[p].data.domain.domain, MAX_DNS_SIZE);
 }
 
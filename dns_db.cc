@@ -3,6 +3,7 @@
 #include <string>
 #include <string.h>
 #include <vector>
+#include <algorithm>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,20 +11,84 @@
 #include <sys/mman.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include "dns_db.h"
 
 
-DNS_DB::DNS_DB(const std::string & path) : blockmgr(this), index(this) {
+DNS_DB::DNS_DB(const std::string & path, bool segmented) : blockmgr(this), index(this), num_changed(0) {
 	db_path = path;
-	
-	// Read index
-	index.unserialize(path + "/index");
+
+	// New DBs might be created in a new directory
+	if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Could not create the DB directory %s!\n", path.c_str());
+		exit(1);
+	}
+
+	bool newdb = !FileMapper::getInstance().fileExists(path + "/index");
+
+	// If it was not closed cleanly the index goes back to the last
+	// checkpoint, the logged changes after it are redone (see wal.cc)
+	std::vector <WriteAheadLog::Record> records;
+	bool clean = wal.open(path + "/wal", records);
+	bool restored = !clean && FileMapper::getInstance().fileExists(path + "/index.ckpt");
+	uint64_t lsn = 0;
+	if (restored)
+		lsn = index.restore(path + "/index.ckpt", path + "/index");
+	else if (!clean) {
+		fprintf(stderr, "Warning: DB %s has no index checkpoint, its logged changes are lost\n", path.c_str());
+		records.clear();
+	}
+
+	if (newdb && segmented) {
+		segments.enable(path);
+		segments.save();
+	}
+	else
+		segments.load(path);
+
+	// The blocks might not have all the pages the checkpoint saved
+	if (restored)
+		restorePages(lsn);
+
+	// Map the index (converting old ones)
+	bool indexclean = index.open(path + "/index");
+
+	// Looking for block files is not cheap, only done after a crash
+	if (segments.isEnabled() || !clean)
+		collectBlocks();
+
+	if (!ipindex.load(path + "/ipindex") && !newdb)
+		fprintf(stderr, "Warning: IP index missing, run rebuild-ipindex\n");
+
+	// Filters for all the existing blocks, so they never move under readers
+	ipbloom.load(path + "/ipbloom");
+	dombloom.load(path + "/dombloom");
+	ipbloom.reserve(index.getMaxBlockId());
+	dombloom.reserve(index.getMaxBlockId());
+	if (newdb) {
+		ipbloom.clear(index.getBlockId(0));
+		dombloom.clear(index.getBlockId(0));
+	}
+
+	if (!clean)
+		recover(lsn, records);
+	else if (!indexclean) {
+		// The changes are there but the counters might not
+		index.recount();
+		index.sync();
+	}
 }
 
 DNS_DB::~DNS_DB() {
-	// Writeback index
-	index.serialize(db_path + "/index");
+	wal.stop();
+	ipindex.save();
+	ipbloom.save();
+	dombloom.save();
+
+	// Readers never started the log
+	if (wal.isActive())
+		closeLog();
 }
 
 std::string to_string(unsigned int n, int n_digits) {
@@ -38,55 +103,517 @@ std::string to_string(unsigned int n, int n_digits) {
 // DB check!
 void DNS_DB::check() {
 	// Do a full DB check. Check the index and then each block
+	ReadGuard g(dblock);
 	index.check();
 }
 
+void DNS_DB::rebuildIpIndex() {
+	WriteGuard g(dblock);
+	for (int n = 0; n < index.getNumNodes(); n++)
+		ipbloom.rebuild(getBlock(index.getBlockId(n)));
+	ipindex.rebuild(&index);
+}
+
+std::vector < std::pair<IPv4, std::string> > DNS_DB::getDomainsByIpv4(IPv4 ip, int prefixlen) {
+	std::vector < std::pair<IPv4, std::string> > ret;
+	ReadGuard g(dblock);
+	std::vector <IpIndex::Entry> entries = ipindex.lookup(ip, prefixlen);
+	for (unsigned int i = 0; i < entries.size(); i++) {
+		char domain[MAX_DNS_SIZE*2];
+		idom2domain(entries[i].domain, domain);
+		ret.push_back(std::make_pair((IPv4)entries[i].ip, std::string(domain)));
+	}
+	return ret;
+}
+
+std::vector < std::pair<IPv4, std::string> > DNS_DB::scanDomainsByIpv4(IPv4 ip, unsigned int * scanned) {
+	std::vector < std::pair<IPv4, std::string> > ret;
+	if (scanned) *scanned = 0;
+
+	ReadGuard g(dblock);
+	for (int n = 0; n < index.getNumNodes(); n++) {
+		unsigned int id = index.getBlockId(n);
+		if (!ipbloom.mayContain(id, ip))
+			continue;
+		if (scanned) (*scanned)++;
+
+		// Regenerate unknown filters while we are at it
+		bool rebuild = !ipbloom.isValid(id);
+		std::vector <uint8_t> filter = ipbloom.newFilter();
+
+		const char * last = 0;
+		getBlock(id)->scanIpsv4([&](const char * domint, const IPv4_Record & rec) {
+			if (rebuild)
+				ipbloom.addTo(filter, &rec.ip, sizeof(rec.ip));
+			if (rec.ip == ip && domint != last) {
+				char domain[MAX_DNS_SIZE*2];
+				idom2domain(domint, domain);
+				ret.push_back(std::make_pair(ip, std::string(domain)));
+				last = domint;
+			}
+		});
+
+		if (rebuild)
+			ipbloom.set(id, filter);
+	}
+	return ret;
+}
+
 DNS_DB::DnsBlock * DNS_DB::getNewBlock(int blockid) {
+	if (segments.isEnabled()) {
+		void * trailer, * directory;
+		void * ptr = segments.getBlock(blockid, &trailer, &directory);
+		return new DNS_DB::DnsBlock(ptr, trailer, directory, blockid);
+	}
+
+	std::string blockfile = getBlockFile(blockid);
+	if (!FileMapper::getInstance().fileExists(blockfile)) {
+		std::string dir2 = blockfile.substr(0, blockfile.rfind('/'));
+		std::string dir1 = dir2.substr(0, dir2.rfind('/'));
+		mkdir((db_path).c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+		mkdir(dir1.c_str(),      S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+		mkdir(dir2.c_str(),      S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+	}
+
+	return new DNS_DB::DnsBlock(blockfile, blockid);
+}
+
+std::string DNS_DB::getBlockFile(int blockid) const {
 	// Generate path in a hierachical way, to prevent many files in a directory
 	// This should be beneficial on most file systems
 	std::string filename = to_string(blockid,16);
 	std::string dir1 = filename.substr(filename.size()-1,1) + "/";
 	std::string dir2 = filename.substr(filename.size()-2,1) + "/";
-	std::string blockfile = db_path + "/" + dir1 + dir2 + filename + ".blk";
+	return db_path + "/" + dir1 + dir2 + filename + ".blk";
+}
 
-	if (!FileMapper::getInstance().fileExists(blockfile)) {
-		mkdir((db_path).c_str(),                           S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-		mkdir((db_path + "/" + dir1).c_str(),              S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-		mkdir((db_path + "/" + dir1 + "/" + dir2).c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+// An empty block, whose ID might have been used before a crash (only the
+// segment storage reuses the storage, zeroing it)
+DNS_DB::DnsBlockPtr DNS_DB::newBlock(int blockid) {
+	std::string blockfile = getBlockFile(blockid);
+	if (!segments.isEnabled() && FileMapper::getInstance().fileExists(blockfile))
+		FileMapper::getInstance().removeFile(blockfile);
+	return getBlock(blockid);
+}
+
+// Releases the storage of a block which is no longer in the index
+void DNS_DB::freeBlock(int blockid) {
+	blockmgr.dropBlock(blockid);
+	ipbloom.clear(blockid);
+	dombloom.clear(blockid);
+
+	if (segments.isEnabled())
+		segments.freeBlock(blockid);
+	else
+		FileMapper::getInstance().removeFile(getBlockFile(blockid));
+}
+
+// The last checkpoint is gone, so are the blocks only it referenced
+void DNS_DB::freeRetired() {
+	for (unsigned int i = 0; i < retired.size(); i++) {
+		freeBlock(retired[i]);
+		index.freeId(retired[i]);
 	}
+	retired.clear();
+}
 
-	return new DNS_DB::DnsBlock(blockfile, blockid);
+// Frees the storage of the blocks not in the index, which a crash might
+// leave behind (freed or created after the last checkpoint)
+void DNS_DB::collectBlocks() {
+	std::vector <bool> inuse(index.getMaxBlockId());
+	for (int n = 0; n < index.getNumNodes(); n++)
+		inuse[index.getBlockId(n)] = true;
+
+	if (segments.isEnabled()) {
+		if (segments.collect(inuse))
+			segments.save();
+		return;
+	}
+	// Newer block files are replaced when their IDs are used again
+	for (unsigned int id = 0; id < inuse.size(); id++) {
+		std::string blockfile = getBlockFile(id);
+		if (!inuse[id] && FileMapper::getInstance().fileExists(blockfile))
+			FileMapper::getInstance().removeFile(blockfile);
+	}
+}
+
+// Returns the file holding a block, and the offsets in it of the block,
+// its trailer and its slot directory
+std::string DNS_DB::locateBlock(int blockid, unsigned long * offsets) const {
+	if (segments.isEnabled())
+		return segments.locate(blockid, offsets);
+	offsets[0] = 0;
+	offsets[1] = DnsBlock::blockSize;
+	offsets[2] = DnsBlock::blockSize + DnsBlock::trailerSize;
+	return getBlockFile(blockid);
+}
+
+// The block is in the last checkpoint, it is changed through a private
+// view until the next one (see writeCheckpoint). They are kept in memory
+// (never evicted) until then
+void DNS_DB::makePrivate(const DnsBlockPtr & blk) {
+	unsigned long offsets[3];
+	blk->setPrivate(locateBlock(blk->getID(), offsets), offsets);
+	changed.push_back(blk);
+	num_changed++;
 }
 
 void DNS_DB::updateIterators() {
+	std::lock_guard <std::mutex> g(iterators_lock);
 	for (unsigned i = 0; i < iterators.size(); i++)
 		iterators[i]->resync();
 }
 
 
 DNS_DB::queryError DNS_DB::addDomain(const std::string & domain) {
-	queryError res = index.addDomain(domain.c_str());
+	char domint[MAX_DNS_SIZE];
+	if (!domain2idom(domain.c_str(), domint))
+		return resDomainTooLong;
+	return addIDomain(domint);
+}
+
+DNS_DB::queryError DNS_DB::addIDomain(const char * domint) {
+	WriteGuard g(dblock);
+	startLog();
+	queryError res = index.addIDomain(domint);
+	if (res == resOK) {
+		wal.append(WriteAheadLog::opAddDomain, domint);
+		logged();
+	}
 	updateIterators();
 	return res;
 }
 
 void DNS_DB::addIp4Record(const std::string & domain, const IPv4_Record & record) {
+	WriteGuard g(dblock);
+	startLog();
 	index.addIp4Record(domain.c_str(), record);
+	char domint[MAX_DNS_SIZE];
+	if (domain2idom(domain.c_str(), domint)) {
+		wal.append(WriteAheadLog::opAddIp4, domint, &record);
+		logged();
+	}
 	updateIterators();
 }
 
 
 void DNS_DB::replaceIpv4(const std::string & domain, const IPv4_Record & oldrec, const IPv4_Record & newrec) {
+	WriteGuard g(dblock);
+	startLog();
 	index.replaceIpv4(domain.c_str(), oldrec, newrec);
+	char domint[MAX_DNS_SIZE];
+	if (domain2idom(domain.c_str(), domint)) {
+		wal.append(WriteAheadLog::opReplaceIp4, domint, &oldrec, &newrec);
+		logged();
+	}
+	updateIterators();
+}
+
+DNS_DB::queryError DNS_DB::deleteDomain(const std::string & domain) {
+	char domint[MAX_DNS_SIZE];
+	if (!domain2idom(domain.c_str(), domint))
+		return resDomainTooLong;
+	return deleteIDomain(domint);
+}
+
+DNS_DB::queryError DNS_DB::deleteIDomain(const char * domint) {
+	WriteGuard g(dblock);
+	startLog();
+	queryError res = index.deleteIDomain(domint);
+	if (res == resOK) {
+		wal.append(WriteAheadLog::opDeleteDomain, domint);
+		index.merge(MERGE_STEP_NODES);
+		logged();
+	}
+	updateIterators();
+	return res;
+}
+
+// Merges and compactions are not logged, they do not change the contents
+unsigned int DNS_DB::mergeBlocks(unsigned int budget) {
+	WriteGuard g(dblock);
+	startLog();
+	unsigned int merged = index.merge(budget);
+	updateIterators();
+	return merged;
+}
+
+// Compacts all the blocks, returns the number of slots freed
+unsigned long DNS_DB::compact() {
+	WriteGuard g(dblock);
+	startLog();
+	unsigned long freed = index.compact();
 	updateIterators();
+	return freed;
+}
+
+// Nothing to do if there were no changes
+void DNS_DB::checkpoint() {
+	WriteGuard g(dblock);
+	if (wal.isActive())
+		checkpointFiles();
+}
+
+/** Logging and recovery */
+
+// Before the first change: the log is marked in use, with a checkpoint
+// of the DB as it is (so a crash goes back to it)
+void DNS_DB::startLog() {
+	if (wal.isActive())
+		return;
+	writeCheckpoint();
+	wal.start();
+}
+
+// After each logged change
+void DNS_DB::logged() {
+	if (wal.getSize() > (unsigned long)WAL_CHECKPOINT_MB * 1024 * 1024)
+		checkpointFiles();
+	else
+		limitChanged();
+}
+
+// The changed pages of the private views are kept in memory until the
+// next checkpoint, which is taken early if there are too many
+void DNS_DB::limitChanged() {
+	if (wal.isActive() && changed.size() > CHECKPOINT_BLOCKS)
+		checkpointFiles();
+}
+
+// Writes a checkpoint of the DB as of the last change:
+// - the DB files are synced (the blocks are written through mappings which
+//   might be gone by now, their pages are still cached, so the whole file
+//   system is). The pages written to the blocks by the previous one too;
+// - the pages changed in the private views are saved (blocks.ckpt);
+// - the index copy (index.ckpt) is written, which commits the checkpoint;
+// - the pages go to the blocks, they are synced by the next one
+void DNS_DB::writeCheckpoint() {
+	wal.commit();
+	uint64_t lsn = wal.mark();
+	index.sync();
+	segments.save();
+	syncFiles();
+	savePages(lsn);
+	index.checkpoint(db_path + "/index.ckpt", lsn);
+
+	// Those freed since are not in it, their changes are dropped
+	for (unsigned int i = 0; i < changed.size(); i++)
+		changed[i]->setShared(std::find(retired.begin(), retired.end(), (unsigned int)changed[i]->getID()) == retired.end());
+	changed.clear();
+	num_changed = 0;
+}
+
+// blocks.ckpt: a header, then the pages with their block ID, offset (in
+// the layout of a block file: block, trailer, directory) and checksum. It
+// replaces the previous one as a whole
+#define PAGES_MAGIC  0x31475042   // "BPG1"
+
+struct PagesHeader {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t lsn;         // Of the checkpoint
+	uint64_t checksum;    // Of this header
+};
+
+struct PageHeader {
+	uint32_t block;
+	uint32_t offset;
+	uint64_t checksum;    // Of the page and the above
+};
+
+static uint64_t page_checksum(PageHeader p, const char * page, unsigned int size) {
+	p.checksum = 0;
+	return word_hash(&p, sizeof(p)) ^ word_hash(page, size);
+}
+
+void DNS_DB::savePages(uint64_t lsn) {
+	std::string file = db_path + "/blocks.ckpt", tmp = file + ".tmp";
+	FILE * fd = fopen(tmp.c_str(), "wb");
+	PagesHeader h;
+	memset(&h, 0, sizeof(h));
+	h.magic = PAGES_MAGIC;
+	h.lsn = lsn;
+	bool ok = fd != NULL && fwrite(&h, 1, sizeof(h), fd) == sizeof(h);
+
+	for (unsigned int i = 0; i < changed.size() && ok; i++) {
+		unsigned int id = changed[i]->getID();
+		if (std::find(retired.begin(), retired.end(), id) != retired.end())
+			continue;
+		changed[i]->scanChanges([&](unsigned int offset, const char * page) {
+			PageHeader p = { id, offset, 0 };
+			p.checksum = page_checksum(p, page, DnsBlock::pageSize);
+			ok = ok && fwrite(&p, 1, sizeof(p), fd) == sizeof(p) && fwrite(page, 1, DnsBlock::pageSize, fd) == DnsBlock::pageSize;
+			h.count++;
+		});
+	}
+
+	h.checksum = word_hash(&h, sizeof(h));
+	ok = ok && fseek(fd, 0, SEEK_SET) == 0 && fwrite(&h, 1, sizeof(h), fd) == sizeof(h);
+	ok = ok && fflush(fd) == 0 && fsync(fileno(fd)) == 0;
+	if (fd)
+		fclose(fd);
+	ok = ok && rename(tmp.c_str(), file.c_str()) == 0;
+
+	// The rename must be on disk before the one of the index copy
+	int dfd = open(db_path.c_str(), O_RDONLY | O_DIRECTORY);
+	ok = ok && dfd >= 0 && fsync(dfd) == 0;
+	if (dfd >= 0)
+		close(dfd);
+	if (!ok) {
+		fprintf(stderr, "Could not write the checkpoint pages %s!\n", file.c_str());
+		exit(1);
+	}
+}
+
+// Writes the pages saved by the checkpoint (lsn) to the blocks again, not
+// all of them might have reached the disk. The file might be from a later
+// checkpoint which was never completed, then it is ignored
+void DNS_DB::restorePages(uint64_t lsn) {
+	std::string file = db_path + "/blocks.ckpt";
+	FILE * fd = fopen(file.c_str(), "rb");
+	if (fd == NULL)
+		return;
+
+	PagesHeader h;
+	uint64_t sum = 0;
+	if (fread(&h, 1, sizeof(h), fd) == sizeof(h)) {
+		sum = h.checksum;
+		h.checksum = 0;
+	}
+	if (h.magic != PAGES_MAGIC || sum != word_hash(&h, sizeof(h)) || h.lsn != lsn) {
+		fclose(fd);
+		return;
+	}
+
+	std::vector <char> page(DnsBlock::pageSize);
+	std::string blockfile;
+	int bfd = -1;
+	for (unsigned int i = 0; i < h.count; i++) {
+		PageHeader p;
+		if (fread(&p, 1, sizeof(p), fd) != sizeof(p) || fread(&page[0], 1, page.size(), fd) != page.size() ||
+			p.checksum != page_checksum(p, &page[0], page.size())) {
+			fprintf(stderr, "Bad checkpoint pages %s!\n", file.c_str());
+			exit(1);
+		}
+
+		unsigned long offsets[3];
+		std::string f = locateBlock(p.block, offsets);
+		unsigned long pos = p.offset < DnsBlock::blockSize ? offsets[0] + p.offset :
+			p.offset < DnsBlock::blockSize + DnsBlock::trailerSize ? offsets[1] + p.offset - DnsBlock::blockSize :
+			offsets[2] + p.offset - DnsBlock::blockSize - DnsBlock::trailerSize;
+		if (f != blockfile) {
+			if (bfd >= 0)
+				close(bfd);
+			blockfile = f;
+			bfd = open(f.c_str(), O_WRONLY);
+		}
+		if (bfd < 0 || pwrite(bfd, &page[0], page.size(), pos) != (ssize_t)page.size()) {
+			fprintf(stderr, "Could not write block %u!\n", p.block);
+			exit(1);
+		}
+	}
+	if (bfd >= 0)
+		close(bfd);
+	fclose(fd);
+}
+
+// The log starts over, the blocks replaced since the previous checkpoint
+// are not needed anymore
+void DNS_DB::checkpointFiles() {
+	assert(wal.isActive());
+	writeCheckpoint();
+	wal.checkpoint(false);
+	freeRetired();
+}
+
+// Everything is on disk (the reverse index and the filters are saved by
+// then), neither the log nor the checkpoint are needed anymore
+void DNS_DB::closeLog() {
+	writeCheckpoint();
+	syncFiles();
+	wal.checkpoint(true);
+	unlink((db_path + "/blocks.ckpt").c_str());
+	freeRetired();
+	segments.save();
 }
 
-DNS_DB::DomainIterator::DomainIterator(DNS_DB::DnsIndex * idx, const char * domint, DNS_DB * dbref) : index(idx),it(idx->getIterator(domint)), db(dbref) {
-	it.getDomain(current_domain);
+void DNS_DB::syncFiles() {
+	int fd = open(db_path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || syncfs(fd) < 0)
+		fprintf(stderr, "Could not sync the DB files in %s!\n", db_path.c_str());
+	if (fd >= 0)
+		close(fd);
+}
+
+// The DB was not closed cleanly and it is back to the last checkpoint (lsn
+// is the last change it has): redoes the changes logged after it, rebuilds
+// what is only saved at close (the counters are recounted too, the reverse
+// index and the filters) and closes the log
+void DNS_DB::recover(uint64_t lsn, const std::vector <WriteAheadLog::Record> & records) {
+	unsigned long nrecs = 0;
+	for (unsigned int i = 0; i < records.size(); i++)
+		nrecs += records[i].lsn > lsn;
+	fprintf(stderr, "Warning: DB %s was not closed cleanly, replaying %lu logged changes\n", db_path.c_str(), nrecs);
+	for (unsigned int i = 0; i < records.size(); i++)
+		if (records[i].lsn > lsn)
+			replay(records[i]);
+
+	index.recount();
+	for (int n = 0; n < index.getNumNodes(); n++) {
+		DnsBlockPtr blk = getBlock(index.getBlockId(n));
+		ipbloom.rebuild(blk);
+		dombloom.rebuild(blk);
+	}
+	ipindex.rebuild(&index);
+	ipindex.save();
+	ipbloom.save();
+	dombloom.save();
+	closeLog();
+}
+
+// The checkpoint does not have the change, it is redone as it was done
+void DNS_DB::replay(const WriteAheadLog::Record & r) {
+	char domain[MAX_DNS_SIZE*2];
+	idom2domain(r.domain, domain);
+	std::vector <IPv4_Record> ips;
+
+	switch (r.type) {
+	case WriteAheadLog::opAddDomain:
+		index.addIDomain(r.domain);
+		break;
+	case WriteAheadLog::opAddIp4:
+		// The domain must be there (adding IPs to a missing one was a no-op)
+		if (index.getDomainIpsv4(r.domain, ips))
+			index.addIp4Record(domain, r.recs[0]);
+		break;
+	case WriteAheadLog::opReplaceIp4:
+		index.replaceIpv4(domain, r.recs[0], r.recs[1]);
+		break;
+	case WriteAheadLog::opDeleteDomain:
+		index.deleteIDomain(r.domain);
+		index.merge(MERGE_STEP_NODES);
+		break;
+	}
+}
+
+DNS_DB::DomainIterator::DomainIterator(DNS_DB::DnsIndex * idx, const char * domint, DNS_DB * dbref) : index(idx),it(idx->getIterator(domint)), db(dbref), moved(false) {
+	// There might be no domains at all
+	memset(current_domain, 0, MAX_DNS_SIZE);
+	if (it.valid())
+		it.getDomain(current_domain);
+	std::lock_guard <std::mutex> g(db->iterators_lock);
+	db->iterators.push_back(this);
+}
+
+// Copies must be tracked too, or they would not be resynced on updates
+DNS_DB::DomainIterator::DomainIterator(const DomainIterator & o) : index(o.index), it(o.it), db(o.db), moved(o.moved) {
+	memcpy(current_domain, o.current_domain, MAX_DNS_SIZE);
+	std::lock_guard <std::mutex> g(db->iterators_lock);
 	db->iterators.push_back(this);
 }
 
 DNS_DB::DomainIterator::~DomainIterator() {
+	std::lock_guard <std::mutex> g(db->iterators_lock);
 	for (unsigned int i = 0; i < db->iterators.size(); i++) {
 		if (db->iterators[i] == this) {
 			db->iterators.erase(db->iterators.begin()+i);
@@ -96,8 +623,18 @@ DNS_DB::DomainIterator::~DomainIterator() {
 }
 
 void DNS_DB::DomainIterator::resync() {
-	// Essentially create a new Index Iterator to point our current domain
+	// Essentially create a new Index Iterator to point our current domain,
+	// if it was deleted it lands on the next one
 	this->it = index->getIterator(current_domain);
+	if (!it.valid())
+		return;
+
+	char domint[MAX_DNS_SIZE];
+	it.getDomain(domint);
+	if (!eq(domint, current_domain)) {
+		memcpy(current_domain, domint, MAX_DNS_SIZE);
+		moved = true;
+	}
 }
 
 
@@ -1,30 +1,88 @@
 
+#ifndef DNS_DB__H__
+#define DNS_DB__H__
+
+
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <memory>
+#include <set>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "record.h"
+#include "rwlock.h"
+#include "queue.h"
 #include "config.h"
 
 #define MAX_DNS_SIZE 35
 
-#define less(a, b)       (strncmp(a, b, MAX_DNS_SIZE) < 0)    // whether a < b
-#define less_eq(a, b)    (strncmp(a, b, MAX_DNS_SIZE) <= 0)   // whether a <= b
+// Keys are zero padded, so they compare as unsigned byte strings of W
+// bytes. That is done on 64 bit big endian words (the last one overlaps
+// the previous if W is not a multiple of 8). Most keys differ in the first
+// word, so key_cmp usually returns after a single load and compare instead
+// of walking the bytes, and the index pages keep that word as their prefix.
+template <unsigned int W> static inline uint64_t key_word(const char * k, unsigned int i) {
+	uint64_t v;
+	memcpy(&v, k + (i + 8 <= W ? i : W - 8), sizeof(v));
+	return __builtin_bswap64(v);
+}
+
+template <unsigned int W> static inline int key_cmp(const char * a, const char * b) {
+	static_assert(W >= 8, "Keys are compared in 64 bit words");
+	for (unsigned int i = 0; i < W; i += 8) {
+		uint64_t wa = key_word<W>(a, i), wb = key_word<W>(b, i);
+		if (wa != wb)
+			return wa < wb ? -1 : 1;
+	}
+	return 0;
+}
+
+template <unsigned int W> static inline bool key_eq(const char * a, const char * b) {
+	uint64_t d = 0;
+	for (unsigned int i = 0; i < W; i += 8)
+		d |= key_word<W>(a, i) ^ key_word<W>(b, i);
+	return d == 0;
+}
+
+#define less(a, b)       (key_cmp<MAX_DNS_SIZE>(a, b) < 0)    // whether a < b
+#define less_eq(a, b)    (key_cmp<MAX_DNS_SIZE>(a, b) <= 0)   // whether a <= b
 #define greater(a, b)    (less(b,a))                          // whether a > b
-#define greater_eq(a, b) (strncmp(a, b, MAX_DNS_SIZE) >= 0)   // whether a >= b
-#define eq(a, b)         (strncmp(a, b, MAX_DNS_SIZE) == 0)   // whether a == b
+#define greater_eq(a, b) (key_cmp<MAX_DNS_SIZE>(a, b) >= 0)   // whether a >= b
+#define eq(a, b)         (key_eq<MAX_DNS_SIZE>(a, b))         // whether a == b
 
 #define DOMAIN_MIN "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
 #define DOMAIN_MAX "\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255\255"
 
+// Internal domains: the first label followed by the code of the rest (a
+// public suffix), zero padded. The original TLDs have one byte codes, the
+// rest two bytes: the first with the top bit set (labels are ASCII) and
+// both non zero. Text domains fit in MAX_DNS_SIZE*2 bytes.
+#define LEGACY_SUFFIX_CODES  18
+#define MAX_SUFFIX_CODES     (40*255)   // Keeps the internal domains below DOMAIN_MAX
+#define MAX_SUFFIX_SIZE      34
+
 bool domain2idom(const char * domain, char * intdom);
 void idom2domain(const char * intdom, char * domain);
+unsigned int suffix2code(const char * suffix, unsigned int len);
+const char * code2suffix(unsigned int code);
+
+// Checksum of the index and log headers and pages, len is a multiple of 8
+uint64_t word_hash(const void * data, unsigned long len);
 
 class DNS_DB {
 public:
-	enum queryError { resOK, resNoSpaceLeft, resAlreadyExists, resDomainTooLong, resErrOther };
+	enum queryError { resOK, resNoSpaceLeft, resAlreadyExists, resNotFound, resDomainTooLong, resErrOther };
+
+	// Microbenchmarks of the internals (bench.cc)
+	friend class Bench;
 
 private:
 
@@ -32,18 +90,26 @@ private:
 	class DnsBlock;
 
 	typedef std::shared_ptr<DnsBlock> DnsBlockPtr;
+	typedef std::function<void(const char * domint, const IPv4_Record & rec)> IpCallback;
+	typedef std::function<void(const char * domint)> DomainCallback;
 
 	class DnsBlock {
 	public:
 		DnsBlock(const std::string & file, int blkid);
+		DnsBlock(void * ptr, void * trailer, void * directory, int blkid);
 		DnsBlock(const DnsBlockPtr & other);
 		~DnsBlock();
 
 		std::vector <IPv4_Record> getIpsv4(int p) const;
+		std::vector <IPv4_Record> getDomainIpsv4(const char * domint) const;
+		void scanIpsv4(const IpCallback & cb) const;
+		void scanDomains(const DomainCallback & cb) const;
 		queryError addDomain(const char * domain);
 		bool hasDomain(const char * domint) const;
 		bool addDomainIpv4    (const char * domint, const IPv4_Record & iprec);
 		bool replaceDomainIpv4(const char * domint, const IPv4_Record & oldred, const IPv4_Record & newrec);
+		bool deleteDomain(const char * domint, std::vector <IPv4_Record> * ips);
+		int compact();
 
 		void check() const;
 
@@ -53,12 +119,27 @@ private:
 		int getID() const { return blockid; }
 		int getNumRecords() const { return bitmap->bitCount(); }
 		int getNumFreeRecords() const { return numBlocks - bitmap->bitCount(); }
-
+		int getNumDomains() const { return trailer->domains; }
+		int getNumIps() const { return trailer->ips; }
+		int getNumDeleted() const { return trailer->deleted; }
+
+		// Private (copy on write) view of the block, from the offsets of
+		// the block, its trailer and its directory in file (see
+		// DNS_DB::makePrivate). setShared copies the pages it changed to
+		// the file mapping, or drops them, and goes back to it
+		void setPrivate(const std::string & file, const unsigned long * offsets);
+		void setShared(bool keep);
+		bool isPrivate() const { return shared[0] != 0; }
+		void scanChanges(const std::function<void(unsigned int offset, const char * page)> & cb) const;
+
+		// Walks the live domains, from domint (or the next one if it is
+		// gone). It is not valid if there are none
 		class Iterator {
 		public:
 			Iterator(int blkid, const char * domint, DNS_DB * dbref);
 			void next();
 			bool end() const;
+			bool valid() const { return p < (int)numBlocks; }
 			void getDomain(char * dom);
 			std::vector <IPv4_Record> getIpsv4() { return db->getBlock(block_id)->getIpsv4(p); }
 			std::string getDomain();
@@ -70,13 +151,20 @@ private:
 
 		Iterator getIterator(DNS_DB * dbref, const char * domint) { return Iterator(blockid, domint, dbref); }
 		
-		void splitBlock(const char * domint, DnsBlockPtr & newblk);
+		void splitBlock(DnsBlockPtr & newblk);
+		void mergeBlock(const DnsBlock * next);
+		void loadSorted(const char * domints, int n);
 
 		void updateBM();
 		void checkBM();
+		void updateCounts();
+		bool recount();
 
 		static unsigned int blockSize;
 		static unsigned int numBlocks;
+		static unsigned int trailerSize;
+		static unsigned int directorySize;
+		static unsigned int pageSize;
 
 	private:
 		struct __attribute__ ((__packed__)) InternalBlock {
@@ -94,82 +182,158 @@ private:
 			} data;
 		};
 
+		// Start of the block trailer, the bitmap follows
+		struct Trailer {
+			uint32_t magic;
+			uint32_t domains;    // Number of (live) domains
+			uint32_t ips;        // and IPv4 records in the block
+			uint32_t directory;  // The slot directory is up to date
+			uint32_t deleted;    // Tombstones, still taking their slots
+			uint32_t pad;
+		};
+
+		static void countChunk(const InternalBlock * ptr, bool * dead, uint32_t * domains, uint32_t * ips, uint32_t * deleted);
+
+		bool isLive(int p) const { return (blockptr[p].header & (flagUsed | flagDomain | flagDeleted)) == (flagUsed | flagDomain); }
+
 		InternalBlock * lookupDomain(const char * domain) const;
 		int lookupEmptyDomainSpot(const char * domain, int * p) const;
+		int lookupDirectory(const char * domain, int * p) const;
 		void makeRoomMove(const char * domain);
+		void rebalance(int ws, int we, int at);
+		void layoutRuns(int ws, int we, const std::vector < std::pair<int,int> > & runs, const InternalBlock * from = 0);
 		bool addDomainIpv4_int(const char * domain, const IPv4_Record & iprec, bool ret);
 
+		void init(void * ptr, void * trailer, void * directory, int blkid);
+		void setView(void * ptr, void * trailer, void * directory);
+		void diffPages(const std::function<void(char * page, char * file, unsigned int offset)> & cb) const;
+
+		// Slot directory upkeep, they just invalidate it if there is none
+		void updateDirectory();
+		void dirInsert(int slot);
+		void dirWindow(int ws, int we);
+		void dirSplit(int pos, DnsBlock * newblk);
+		unsigned int dirSize() const { return trailer->domains + trailer->deleted; }
+
 		InternalBlock * blockptr;
 		InternalBlock * endptr;
 		int blockid;
+		bool mapped;    // Owns a FileMapper mapping
 		std::shared_ptr<Bitmap> bitmap;
+		Trailer * trailer;
+		uint16_t * directory;    // Domain slots in order (SLOT_DIRECTORY builds)
+		char * shared[3];        // File mapping of the above, if private
 
 		static unsigned char flagUsed;
 		static unsigned char flagDomain;
+		static unsigned char flagDeleted;
 	};
 	
+	// Bits are kept in external memory (the block trailer), numBits/8 bytes
+	// as 64 bit words. A summary level (in memory) has a bit per word telling
+	// whether it has any bit set and another one whether it has any bit
+	// clear, so searches skip over empty (or full) words 64 at a time. The
+	// number of bits set is cached.
 	class Bitmap {
 	public:
-		Bitmap(int numBits);
+		Bitmap(int numBits, void * mem);
 		int getFirst(bool set) const;
 		int getRightSet (unsigned int pos) const;
-		int bitCount() const;
-		void clear() { bitm = std::vector<unsigned int> (bitm.size()); }
+		int bitCount() const { return count; }
+		int countRange(unsigned int from, unsigned int to) const;
+		void clear();
 
 		void setBit(unsigned int pos, int value) {
-			unsigned int idx = pos / (8*sizeof(unsigned int));
-			unsigned int off = pos % (8*sizeof(unsigned int));
-			if (value)
-				bitm[idx] |=  (1<<off);
-			else
-				bitm[idx] &= ~(1<<off);
+			unsigned int idx = pos / 64;
+			uint64_t mask = 1ULL << (pos % 64);
+			uint64_t old = bitm[idx];
+			uint64_t w = value ? (old | mask) : (old & ~mask);
+			if (w == old)
+				return;
+			bitm[idx] = w;
+			count += value ? 1 : -1;
+			summarize(idx);
 		}
 
 		bool getBit(unsigned int pos) const {
-			unsigned int idx = pos / (8*sizeof(unsigned int));
-			unsigned int off = pos % (8*sizeof(unsigned int));
-			return (bitm[idx] & (1<<off)) != 0;
+			return (bitm[pos / 64] & (1ULL << (pos % 64))) != 0;
 		}
 	private:
-		std::vector <unsigned int> bitm;
+		void summarize(unsigned int idx) {
+			uint64_t bit = 1ULL << (idx % 64);
+			if (bitm[idx])  nonzero[idx / 64] |= bit; else nonzero[idx / 64] &= ~bit;
+			if (~bitm[idx]) nonfull[idx / 64] |= bit; else nonfull[idx / 64] &= ~bit;
+		}
+		int nextWord(const std::vector <uint64_t> & summary, unsigned int idx) const;
+
+		uint64_t * bitm;
+		unsigned int nwords;
+		int count;
+		std::vector <uint64_t> nonzero, nonfull;
 	};
 
 	class DnsIndex {
 	public:
+		friend class Bench;
 		DnsIndex(DNS_DB * d);
 
+		// Blocks might have no live domains (all deleted), they are skipped
 		class Iterator {
 		public:
 			// Modifiers
-			Iterator(DnsIndex * i, int n, const char * domint, DNS_DB * dbref) : p(n), idx(i), block_it(i->getBlock(n)->getIterator(dbref, domint)), db(dbref) {}
+			Iterator(DnsIndex * i, int n, const char * domint, DNS_DB * dbref) : p(n), idx(i), block_it(i->getBlock(n)->getIterator(dbref, domint)), db(dbref) { skipEmpty(); }
 			void next() {
 				if (block_it.end()) {
 					p++;
 					block_it = idx->getBlock(p)->getIterator(db, 0);
+					skipEmpty();
 				}
 				else
 					block_it.next();
 			}
 
 			// Query
-			bool end() const { return block_it.end() && p == idx->nodes.size()-1; }
+			bool valid() const { return block_it.valid(); }
+			bool end() const { return !block_it.valid() || (block_it.end() && !domainsAfter()); }
 			void getDomain(char * dom) { block_it.getDomain(dom); }
 			std::string getDomain() { return block_it.getDomain(); }
 			std::vector <IPv4_Record> getIpsv4() { return block_it.getIpsv4(); }
 		private:
+			void skipEmpty() {
+				while (!block_it.valid() && p+1 < idx->nodes.size())
+					block_it = idx->getBlock(++p)->getIterator(db, 0);
+			}
+			bool domainsAfter() const {
+				for (unsigned int i = p+1; i < idx->nodes.size(); i++)
+					if (idx->nodes[i].domains)
+						return true;
+				return false;
+			}
+
 			unsigned int p;
 			DnsIndex * idx;
 			DnsBlock::Iterator block_it;
 			DNS_DB * db;
 		};
 	
-		void serialize(std::string file);
-		void unserialize(const std::string & file);
+		bool open(const std::string & file);
+		void sync();
+
+		// Checkpoint copy of the index (see wal.cc): checkpoint writes it,
+		// lsn being the last logged change it has. restore replaces the
+		// index file with it and returns its lsn
+		void checkpoint(const std::string & file, uint64_t lsn);
+		uint64_t restore(const std::string & file, const std::string & index);
 
 		queryError addDomain(const char * domain);
+		queryError addIDomain(const char * domint);
 		bool hasDomain(const char * domain);
+		bool getDomainIpsv4(const char * domint, std::vector <IPv4_Record> & ips);
 		void addIp4Record(const char * domain, const IPv4_Record & record);
 		void replaceIpv4(const char * domain, const IPv4_Record & oldrec, const IPv4_Record & newrec);
+		queryError deleteIDomain(const char * domint);
+		unsigned long compact();
+		unsigned int merge(unsigned int budget);
 
 		void check();
 
@@ -177,12 +341,31 @@ private:
 		void getBlkMax(int n, char * v);
 		void getBlkMin(int n, char * v);
 		int addBlock(unsigned int nwblk_id, const char * vmin, const char * vmax);
+		void appendBlock(unsigned int nwblk_id, const char * vmin);
+		unsigned int getMaxBlockId() const { return current_id; }
+		unsigned int getBlockId(int n) const { return nodes[n].dnsblock_id; }
+		int getNumNodes() const { return nodes.size(); }
+		unsigned int getNumSplits() const { return num_splits; }
+		bool isEmpty();
 
 		Iterator getIterator() { return Iterator(this, 0, 0, database); }
 		Iterator getIterator(const char * domint);
 
+		// From the node counters, without opening the blocks
 		unsigned long getNumberRecords();
 		unsigned long getNumberFreeRecords();
+		unsigned long getNumberDomains();
+		unsigned long getNumberIps();
+		void updateCounts(int n, const DnsBlockPtr & blk);
+		void recount();
+
+		// The blocks in the last checkpoint are changed through private
+		// views, the ones created since in place. Freed IDs are reused
+		DnsBlockPtr writeBlock(int n);
+		DnsBlockPtr newBlock();
+		void freeId(unsigned int id) { free_ids.push_back(id); }
+
+		void scanIpsv4(const IpCallback & cb);
 
 	private:
 		class __attribute__ ((__packed__)) Node {
@@ -192,30 +375,178 @@ private:
 
 			uint32_t dnsblock_id; // Id for the DNS block
 
+			// Contents of the block (mirrored here so they can be counted
+			// without opening the blocks)
+			uint16_t used;        // Slots in use
+			uint16_t domains;
+			uint32_t ips;         // IPv4 records
+
 			static bool lessthan (const Node & a, const Node & b) { return less(a.min,b.min); }
 		};
 
+		// B+tree of nodes sorted by min, with subtree counts in the inner
+		// pages so nodes can also be accessed by rank (position), all in
+		// O(log n). Pages live in an arena and reference each other by
+		// number. Searches compare the first 8 bytes of the keys as integers
+		// (kept in a separate array in each page) and only look at the full
+		// keys on ties. Node min values must only be changed with setMin().
+		//
+		// The arena is an anonymous mapping or, once saved, the index file
+		// itself (mapped shared), so the tree is used in place without
+		// loading it and modified pages are written back by the kernel.
+		class NodeTree {
+		public:
+			NodeTree();
+			~NodeTree();
+
+			unsigned int size() const { return root == NO_PAGE ? 0 : total; }
+			const Node & operator[](unsigned int rank) const { return *lookupRank(rank); }
+
+			unsigned int find(const char * key) const;
+			unsigned int insert(const Node & node);
+			void erase(unsigned int rank);
+			void setMin(unsigned int rank, const char * vmin);
+			void setMax(unsigned int rank, const char * vmax);
+			void setCounts(unsigned int rank, unsigned int used, unsigned int domains, unsigned int ips);
+			void scan(const std::function<void(const Node & n)> & cb) const;
+			void clear();
+			void build(const std::vector <Node> & sorted);
+
+			// Index file: open returns false if it is not in this format,
+			// write writes a copy of the tree to a new file (lsn goes to its
+			// header), save does it and switches to the new file, sync
+			// updates the checksums and flushes the file
+			bool open(const std::string & file, uint32_t * next_id);
+			bool write(const std::string & file, uint32_t next_id, uint64_t lsn) const;
+			bool save(const std::string & file, uint32_t next_id);
+			void sync(uint32_t next_id);
+			bool verify() const;
+
+			// Of the file opened
+			bool wasClean() const { return was_clean; }
+			uint64_t getLsn() const { return lsn; }
+
+			// Reads the nodes (sorted) of an index file in the previous
+			// version of the format
+			static bool readOld(const std::string & file, std::vector <Node> & sorted);
+
+		private:
+			NodeTree(const NodeTree &) = delete;
+
+			static const uint32_t NO_PAGE = ~0U;
+			static const unsigned int HEADER = 8;
+			static const unsigned int LEAF_MAX  = (INDEX_PAGE_SIZE - HEADER) / (sizeof(Node) + 8);
+			static const unsigned int INNER_MAX = (INDEX_PAGE_SIZE - HEADER) / (MAX_DNS_SIZE + 16);
+
+			struct Page {
+				uint16_t n;      // Number of entries
+				uint16_t leaf;
+				uint32_t check;  // Checksum (as of the last sync)
+				union {
+					struct {
+						uint64_t prefix[LEAF_MAX];            // Of each node min
+						Node node[LEAF_MAX];
+					} entries;
+					struct {
+						uint64_t prefix[INNER_MAX];           // Of each key
+						uint32_t child[INNER_MAX];
+						uint32_t count[INNER_MAX];            // Nodes under each child
+						char key[INNER_MAX][MAX_DNS_SIZE];    // Min of each child
+					} inner;
+					char raw[INDEX_PAGE_SIZE - HEADER];
+				};
+
+				const char * firstKey() const { return leaf ? entries.node[0].min : inner.key[0]; }
+			};
+
+			// First page of the index file
+			struct FileHeader {
+				uint32_t magic;
+				uint32_t version;
+				uint32_t page_size;
+				uint32_t clean;       // Page checksums are up to date
+				uint32_t root;
+				uint32_t total;
+				uint32_t npages;      // Pages in use
+				uint32_t next_id;     // Next block ID
+				uint64_t checksum;    // Of this header
+				uint32_t free_head;   // First free page (version 3)
+				uint32_t pad;
+				uint64_t lsn;         // Of a checkpoint copy (version 4)
+			};
+
+			uint32_t newPage(bool leaf);
+			void freePage(uint32_t pid);
+			void rebuildFreeList();
+			void markPages(uint32_t pid, std::vector <bool> & used) const;
+			void touch(uint32_t pid);
+			void updateHeader();
+			void scanPage(uint32_t pid, const std::function<void(const Node & n)> & cb) const;
+			void grow(uint32_t capacity);
+			void unmap();
+			unsigned int pageTotal(uint32_t pid) const;
+			unsigned int checkPage(uint32_t pid, const char * lo, const char * hi, bool * ok) const;
+			uint32_t insertRec(uint32_t pid, const Node & node, unsigned int * rank);
+			Node * lookupRank(unsigned int rank) const;
+			int childFor(const Page * p, uint64_t kp, const char * key) const;
+			int entryFor(const Page * p, uint64_t kp, const char * key) const;
+
+			// Mapping: the header page followed by the pages
+			char * base;
+			Page * pages;
+			FileHeader * header;
+			uint32_t npages, capacity;
+			int fd;                          // Index file, -1 if anonymous
+			std::vector <uint8_t> dirty;     // Pages modified since the last sync
+
+			uint32_t root;
+			unsigned int total;
+			uint32_t free_head;              // Free pages, linked through child[0]
+			bool was_clean;
+			uint64_t lsn;
+		};
+
 		DnsBlockPtr getBlock(int n) {
 			return database->getBlock(nodes[n].dnsblock_id);
 		}
 
 		int lookupNode(const char * domain) const;
-
-		std::vector <Node> nodes;
+		void splitNode(int n);
+		void checkInsert(int n, const DnsBlockPtr & blk);
+		int compactNode(int n);
+		bool mergeNodes(int n);
+		bool isWritable(unsigned int id, const DnsBlockPtr & blk) const { return (id < fresh.size() && fresh[id]) || blk->isPrivate(); }
+		void findFreeIds();
+
+		NodeTree nodes;
 		DNS_DB * database;
 		unsigned int current_id;
+		std::vector <unsigned int> free_ids;
+		std::vector <bool> fresh;     // Blocks created since the last checkpoint
+		std::atomic <unsigned int> num_splits;
+		unsigned int merge_cursor;    // Next node looked at by merge()
+
+		// Concurrent domain inserts share it, splits hold it exclusively
+		RWLock split_lock;
 	};
 
 
 	class FileMapper {
 	public:
+		FileMapper() : cached_head(0), cached_tail(0), mapped_referenced(0), mapped_cached(0) {}
+
 		void * mapFile(const std::string & file);
 		void flush(void * ptr);
 		void unmap(void * ptr);
 		void refinc(void * ptr);
 		bool fileExists(const std::string & file) const;
 		void createFile(const std::string & file, int size) const;
+		void removeFile(const std::string & file);
+		void extendFile(const std::string & file, int size) const;
+		void * mapPrivate(const std::string & file, unsigned long offset, unsigned long size) const;
+		void unmapPrivate(void * ptr, unsigned long size) const;
 		int getRefs(void * ptr) const;
+		int getSize(void * ptr) const;
 
 		static FileMapper& getInstance() {
 			static FileMapper INSTANCE;
@@ -230,39 +561,248 @@ private:
 			int fd;           // FD
 			int size;         // Size of the mapping
 			std::string file; // Name of the file
+			MappedFile * prev, * next;  // Cached list (refs == 0), oldest first
 		};
-		std::vector <MappedFile> files;
-
-		void deallocate(int p);
+		// Mappings indexed by path and by address
+		std::unordered_map <std::string, MappedFile> files;
+		std::unordered_map <void*, MappedFile*> mappings;
+		MappedFile * cached_head, * cached_tail;
+		unsigned long mapped_referenced, mapped_cached;
+		mutable std::mutex lock;
+
+		MappedFile * lookup(void * ptr) const;
+		void addRef(MappedFile * f);
+		void cacheUnlink(MappedFile * f);
+		void cacheAppend(MappedFile * f);
+		void deallocate(MappedFile * f);
 		void flushCached();
 	};
 
+	// Storage backend that keeps the blocks as fixed size extents inside a
+	// few big preallocated segment files, which are mapped once. The block
+	// ID -> extent table is stored in its own file.
+	class SegmentStore {
+	public:
+		SegmentStore() : enabled(false) {}
+		~SegmentStore();
+
+		void enable(const std::string & path);
+		bool isEnabled() const { return enabled; }
+
+		void * getBlock(unsigned int blkid, void ** trailer, void ** directory);
+		void freeBlock(unsigned int blkid);
+		unsigned int collect(const std::vector <bool> & inuse);
+		std::string locate(unsigned int blkid, unsigned long * offsets) const;
+
+		const std::vector <uint32_t> & getTable() const { return extents; }
+		void setTable(const std::string & path, const std::vector <uint32_t> & table);
+
+		// Block -> extent table file, load enables the storage if it exists
+		void load(const std::string & path);
+		void save();
+
+	private:
+		std::string getFile(unsigned int seg) const;
+		void * getExtent(uint32_t e);
+		void * getTrailer(uint32_t e);
+		void * getDirectory(uint32_t e);
+
+		bool enabled;
+		std::string path;
+		std::vector <void*> segments;        // Mapped segments
+		std::vector <uint32_t> extents;      // Block ID -> extent
+		std::vector <uint32_t> free_extents;
+		uint32_t next_extent;
+	};
+
+	// Cache of open blocks. Replacement uses the CLOCK algorithm: blocks sit
+	// in a ring of slots with a referenced bit that is set on every access.
+	// The hand sweeps the ring clearing the bits and evicts the first block
+	// found unreferenced (and not in use elsewhere), so lookup, touch and
+	// eviction are all O(1) (amortized). Hits only need the read lock (the
+	// referenced bit is set atomically), misses take the write lock.
 	class BlockManager {
 	public:
-		BlockManager(DNS_DB * db) : tid(0), db(db) {}
+		BlockManager(DNS_DB * db) : hand(0), hits(0), misses(0), evictions(0), db(db) {}
 		DnsBlockPtr getBlock(int id);
 
+		unsigned long getHits() const { return hits; }
+		unsigned long getMisses() const { return misses; }
+		unsigned long getEvictions() const { return evictions; }
+
+		// Forgets a block being freed (it lives until it is not in use)
+		void dropBlock(int id);
+
 	private:
 		void flushUnusedBlocks();
 
 		class CachedBlock {
 		public:
-			CachedBlock() : t(0) {}
+			CachedBlock() : id(-1), referenced(false) {}
+			int id;
 			std::shared_ptr<DnsBlock> b;
-			unsigned long t;
+			bool referenced;   // Only accessed atomically (hits set it under the read lock)
 		};
-		std::map < int, CachedBlock > blocks;
-		int tid;
+		std::vector < CachedBlock > slots;
+		std::vector < unsigned int > free_slots;
+		std::unordered_map < int, unsigned int > blocks;  // Block ID -> slot
+		unsigned int hand;
+		std::atomic <unsigned long> hits, misses, evictions;
+		RWLock lock;
 		DNS_DB * db;
 	};
 
-	class IpBloomFilter {
+	// Reverse index IPv4 -> domain. The base is a sorted array of entries
+	// in a file which is mmapped. Updates go to in-memory delta sets
+	// (additions and removals) which are merged into a new base file
+	// when they grow too big or at shutdown.
+	class IpIndex {
 	public:
+		struct __attribute__ ((__packed__)) Entry {
+			uint32_t ip;
+			char domain[MAX_DNS_SIZE];
+
+			bool operator<(const Entry & o) const { return ip < o.ip || (ip == o.ip && less(domain, o.domain)); }
+		};
+
+		IpIndex() : base(0), base_size(0), nentries(0) {}
+		~IpIndex();
+
+		bool load(const std::string & file);
+		void save();
+		void rebuild(DnsIndex * idx);
+
+		void add(IPv4 ip, const char * domint);
+		void remove(IPv4 ip, const char * domint);
+		std::vector <Entry> lookup(IPv4 ip, int prefixlen) const;
+
+	private:
+		void mapBase();
+		void unmapBase();
+		void writeBase(const std::vector <Entry> & entries);
+		const Entry * lowerBound(IPv4 ip) const;
+
+		std::string file;
+		void * base;
+		unsigned long base_size;
+		uint32_t nentries;
+		std::set <Entry> added, removed;
+	};
+
+	// Set of Bloom filters, one per block (indexed by block ID), persisted
+	// in a sidecar file. Filters for blocks we know nothing about (i.e. DBs
+	// created before the sidecar existed) are invalid and match anything.
+	class BlockBloomFilter {
+	public:
+		BlockBloomFilter(unsigned int bytes, unsigned int nhashes) : fbytes(bytes), nhashes(nhashes) {}
+
+		void load(const std::string & file);
+		void save();
+
+		void reserve(unsigned int nblocks);
+		void clear(unsigned int blkid);
+		bool isValid(unsigned int blkid) const { return blkid < valid.size() && __atomic_load_n(&valid[blkid], __ATOMIC_ACQUIRE); }
+		void add(unsigned int blkid, const void * key, int len);
+		bool mayContain(unsigned int blkid, const void * key, int len) const;
+
+		// Filters can also be built aside and then published, which is safe
+		// against concurrent readers (for already reserved blocks)
+		std::vector <uint8_t> newFilter() const { return std::vector <uint8_t> (fbytes); }
+		void addTo(std::vector <uint8_t> & f, const void * key, int len) const;
+		void set(unsigned int blkid, const std::vector <uint8_t> & f);
+
+		unsigned int getNumFilters() const { return valid.size(); }
+		unsigned long getMemory() const { return filters.size() + valid.size(); }
+		double getFalsePositiveRate() const;
 
 	private:
+		void setBits(uint8_t * f, const void * key, int len) const;
+
+		std::string file;
+		unsigned int fbytes, nhashes;
+		std::vector <uint8_t> filters;
+		std::vector <uint8_t> valid;
+		std::mutex publish;
+	};
+
+	// Filters of the IPs stored in each block, to skip blocks during IP scans
+	class IpBloomFilter : public BlockBloomFilter {
+	public:
+		IpBloomFilter() : BlockBloomFilter(IPBLOOM_BYTES, IPBLOOM_HASHES) {}
 
+		void add(unsigned int blkid, IPv4 ip) { BlockBloomFilter::add(blkid, &ip, sizeof(ip)); }
+		bool mayContain(unsigned int blkid, IPv4 ip) const { return BlockBloomFilter::mayContain(blkid, &ip, sizeof(ip)); }
+		void rebuild(const DnsBlockPtr & blk);
 	};
 
+	// Filters of the domains stored in each block, to answer most negative
+	// lookups without touching the block
+	class DomainBloomFilter : public BlockBloomFilter {
+	public:
+		DomainBloomFilter() : BlockBloomFilter(DOMBLOOM_BYTES, DOMBLOOM_HASHES), lookups(0), negatives(0), false_positives(0) {}
+
+		void add(unsigned int blkid, const char * domint) { BlockBloomFilter::add(blkid, domint, MAX_DNS_SIZE); }
+		bool mayContain(unsigned int blkid, const char * domint) const { return BlockBloomFilter::mayContain(blkid, domint, MAX_DNS_SIZE); }
+		void rebuild(const DnsBlockPtr & blk);
+
+		// Lookup stats
+		std::atomic <unsigned long> lookups, negatives, false_positives;
+	};
+
+	// Write-ahead log of the changes (see wal.cc), written in groups with
+	// one sync each. It is replayed on open (on top of the last checkpoint)
+	// if the DB was not closed cleanly, and truncated by each checkpoint
+	class WriteAheadLog {
+	public:
+		enum opType { opAddDomain = 1, opAddIp4, opReplaceIp4, opDeleteDomain };
+
+		struct __attribute__ ((__packed__)) Record {
+			uint64_t lsn;                  // Sequence number
+			uint32_t check;                // Checksum of the record
+			uint8_t type;
+			char domain[MAX_DNS_SIZE];
+			IPv4_Record recs[2];           // Record added (or old and new ones)
+		};
+
+		WriteAheadLog();
+		~WriteAheadLog();
+
+		bool open(const std::string & file, std::vector <Record> & replay);
+		void start();
+		void stop();
+
+		uint64_t append(uint8_t type, const char * domint, const IPv4_Record * rec = 0, const IPv4_Record * newrec = 0);
+		void commit();
+		void checkpoint(bool clean);
+
+		bool isActive() const { return active; }
+		uint64_t mark();
+		unsigned long getSize() const { return log_size; }
+		unsigned long getNumRecords() const { return num_records; }
+		unsigned long getNumCommits() const { return num_commits; }
+
+	private:
+		static uint32_t checksum(Record r);
+		uint64_t append(Record & r);
+		void commitGroup();
+		void flush();
+		void writeHeader(uint64_t checkpoint, bool clean);
+
+		int fd;
+		bool active, stopping;
+		uint64_t next_lsn;
+		std::vector <Record> pending;      // Group being filled
+		std::vector <Record> writing;      // and being written
+		std::atomic <unsigned long> log_size, num_records, num_commits;
+		std::mutex lock;                   // Appends
+		std::mutex commit_lock;            // One group written at a time
+		std::condition_variable wake;
+		std::thread flusher;
+	};
+
+	// Segment storage (if enabled), must outlive the cached blocks
+	SegmentStore segments;
+
 	// Block manager contains all the cached and used blocks
 	BlockManager blockmgr;
 
@@ -270,27 +810,104 @@ private:
 	DnsIndex index;
 	std::string db_path;
 
+	// Reverse IP index
+	IpIndex ipindex;
+	IpBloomFilter ipbloom;
+	DomainBloomFilter dombloom;
+
+	// Write-ahead log
+	WriteAheadLog wal;
+
+	// Blocks freed since the last checkpoint (which still needs them), and
+	// blocks in it changed since, through private views. The sharded
+	// writer reads the count of the latter while its writers run
+	std::vector <unsigned int> retired;
+	std::vector <DnsBlockPtr> changed;
+	std::atomic <unsigned int> num_changed;
+
 	void load(std::string path);
 	DnsBlockPtr getBlock(int blockid) { return blockmgr.getBlock(blockid); }
 	DnsBlock * getNewBlock(int blockid);
+	DnsBlockPtr newBlock(int blockid);
+	std::string getBlockFile(int blockid) const;
+	void freeBlock(int blockid);
+	void retireBlock(int blockid) { retired.push_back(blockid); }
+	void freeRetired();
+	void collectBlocks();
+	std::string locateBlock(int blockid, unsigned long * offsets) const;
+	void makePrivate(const DnsBlockPtr & blk);
 
 	// Internal stuff
 	void updateIterators();
 
+	// Logging and recovery (write lock held)
+	void startLog();
+	void logged();
+	void limitChanged();
+	void writeCheckpoint();
+	void savePages(uint64_t lsn);
+	void restorePages(uint64_t lsn);
+	void checkpointFiles();
+	void closeLog();
+	void syncFiles();
+	void recover(uint64_t lsn, const std::vector <WriteAheadLog::Record> & records);
+	void replay(const WriteAheadLog::Record & r);
+
 public:
-	DNS_DB(const std::string & path);
+	/**
+	 * Concurrency
+	 *
+	 * A DNS_DB can be shared by several threads. Queries (hasDomain, the
+	 * reverse IP lookups, the counters and the DomainIterator methods) hold
+	 * a shared lock so they run in parallel, while modifiers hold it
+	 * exclusively, so writes are serialized against all the readers. The
+	 * block cache and the file mapper have their own (short) locks: cache
+	 * hits only take the cache read lock. Each DomainIterator must only be
+	 * used by one thread at a time.
+	**/
+
+	// The segmented flag selects the storage backend for new DBs, existing
+	// ones keep using whatever they were created with
+	DNS_DB(const std::string & path, bool segmented = false);
 	~DNS_DB();
 
 	// Modifiers
 	queryError addDomain(const std::string & domain);
+	queryError addIDomain(const char * domint);
 	void addIp4Record(const std::string & domain, const IPv4_Record & record);
 	void replaceIpv4(const std::string & domain, const IPv4_Record & oldrec, const IPv4_Record & newrec);
 
+	// Deletes only tombstone the domain (its IPs leave the reverse index),
+	// the slots are reclaimed when the block is compacted: once enough of
+	// its domains are deleted, before splitting it or by calling compact()
+	queryError deleteDomain(const std::string & domain);
+	queryError deleteIDomain(const char * domint);
+	unsigned long compact();
+
+	// Merges adjacent blocks which fit in one (see MERGE_MAX_FILL), looking
+	// at up to budget index nodes from where the last call stopped. Deletes
+	// do a small step each. Returns the number of blocks freed
+	unsigned int mergeBlocks(unsigned int budget = ~0U);
+
+	// Changes are logged and become durable in groups, within WAL_GROUP_MS
+	// (see wal.cc). commit() waits until all the changes so far are durable,
+	// checkpoint() syncs the DB files so the log can start over (done as it
+	// grows past WAL_CHECKPOINT_MB, after the bulk writers and at close).
+	// The log is only started by the first change
+	void commit() { wal.commit(); }
+	void checkpoint();
+
 	// Queries
-	bool hasDomain(const std::string & domain) { return index.hasDomain(domain.c_str()); }
+	bool hasDomain(const std::string & domain) { ReadGuard g(dblock); return index.hasDomain(domain.c_str()); }
+
+	// Reverse lookups: domains with an IP in ip/prefixlen, sorted by IP
+	std::vector < std::pair<IPv4, std::string> > getDomainsByIpv4(IPv4 ip, int prefixlen = 32);
+	// Same but scanning the blocks (skipping those whose IP filter rules it out)
+	std::vector < std::pair<IPv4, std::string> > scanDomainsByIpv4(IPv4 ip, unsigned int * scanned = 0);
 
 	// Maintenance
 	void check();
+	void rebuildIpIndex();
 
 	class DomainIterator {
 	public:
@@ -298,44 +915,159 @@ public:
 
 		// Modify
 		DomainIterator(DNS_DB::DnsIndex * idx, const char * domint, DNS_DB * dbref);
+		DomainIterator(const DomainIterator & o);
 		~DomainIterator();
 		void next() {
+			ReadGuard g(db->dblock);
+			// Already moved to the next one if the current was deleted
+			if (!moved)
+				it.next();
+			moved = false;
 			// Save the current domain to resync
-			it.next();
 			it.getDomain(current_domain);
 		}
 		void addIpv4(const IPv4_Record & rec) { db->addIp4Record(getDomain(), rec); }
 
 		// Query
-		bool end() const { return it.end(); }
-		std::string getDomain() { return it.getDomain(); }
-		std::vector <IPv4_Record> getIpsv4() { return it.getIpsv4(); }
+		bool end() const { ReadGuard g(db->dblock); return it.end(); }
+		std::string getDomain() { ReadGuard g(db->dblock); return it.getDomain(); }
+		std::vector <IPv4_Record> getIpsv4() { ReadGuard g(db->dblock); return it.getIpsv4(); }
 
 	private:
 		DnsIndex * index;
 		DnsIndex::Iterator it;
 		DNS_DB * db;
 		char current_domain[MAX_DNS_SIZE];
+		bool moved;
 
 		void resync();
 	};
 
-	DomainIterator getDomainIterator() { return DomainIterator(&index, 0, this); }
+	DomainIterator getDomainIterator() { ReadGuard g(dblock); return DomainIterator(&index, 0, this); }
 	DomainIterator getDomainIterator(const std::string & domain) {
 		char domint[MAX_DNS_SIZE];
 		if (!domain2idom(domain.c_str(), domint)) {
 			fprintf(stderr,"Error in domain name\n");
 		}
+		ReadGuard g(dblock);
 		return DomainIterator(&index, domint, this);
 	}
 
-	unsigned long getNumberRecords() { return index.getNumberRecords(); }
-	unsigned long getNumberFreeRecords() { return index.getNumberFreeRecords(); }
+	bool isEmpty() { ReadGuard g(dblock); return index.getNumberDomains() == 0; }
+	unsigned long getNumberRecords() { ReadGuard g(dblock); return index.getNumberRecords(); }
+	unsigned long getNumberFreeRecords() { ReadGuard g(dblock); return index.getNumberFreeRecords(); }
+	unsigned long getNumberDomains() { ReadGuard g(dblock); return index.getNumberDomains(); }
+	unsigned long getNumberIps() { ReadGuard g(dblock); return index.getNumberIps(); }
+
+	// Block cache stats
+	unsigned long getCacheHits() const { return blockmgr.getHits(); }
+	unsigned long getCacheMisses() const { return blockmgr.getMisses(); }
+	unsigned long getCacheEvictions() const { return blockmgr.getEvictions(); }
+	bool isSegmented() const { return segments.isEnabled(); }
+
+	// Write-ahead log stats: records logged and group commits
+	unsigned long getLogRecords() const { return wal.getNumRecords(); }
+	unsigned long getLogCommits() const { return wal.getNumCommits(); }
+
+	// Domain filter stats: memory used (bytes) and estimated false positive rate
+	unsigned long getDomainFilterMemory() const { return dombloom.getMemory(); }
+	double getDomainFilterFPRate() const { return dombloom.getFalsePositiveRate(); }
+	void getDomainFilterStats(unsigned long * lookups, unsigned long * negatives, unsigned long * fps) const {
+		*lookups = dombloom.lookups; *negatives = dombloom.negatives; *fps = dombloom.false_positives;
+	}
+
+	// Bulk loader: sorts the input externally (spilling sorted runs to disk)
+	// and builds the blocks sequentially at a target fill factor. Blocks are
+	// written directly, bypassing the lookup/move/split insertion path.
+	// If the DB already has data the merged stream is inserted in order.
+	// Nothing is logged, finish() checkpoints the DB.
+	class BulkLoader {
+	public:
+		BulkLoader(DNS_DB * dbref, float fill = BULK_FILL_FACTOR);
+		~BulkLoader();
+
+		queryError addDomain(const std::string & domain);
+		queryError addIDomain(const char * domint);
+		void finish();
+
+		unsigned long getNumAdded() const { return num_added; }
+		unsigned long getNumDuplicated() const { return num_dups; }
+		unsigned int getNumRuns() const { return num_runs; }
+
+	private:
+		void spillRun();
+		void emitDomain(const char * domint);
+		void emitBlock();
+
+		DNS_DB * db;
+		int keys_per_block;
+		bool direct;                     // Empty DB, write blocks directly
+		std::vector <char> buffer;       // Current (unsorted) run
+		std::vector <std::string> runs;  // Spilled run files
+		std::vector <char> blkbuf;       // Keys for the block being built
+		char last[MAX_DNS_SIZE];         // Last emitted key, to drop dups
+		bool first_block, has_last;
+		unsigned long num_added, num_dups;
+		unsigned int num_runs;
+	};
+
+	// Parallel writer: the key space is partitioned in contiguous ranges of
+	// index nodes, one per writer thread, so each writer owns its blocks.
+	// Splits happen inside a node (so they never cross shards) and only
+	// serialize against the other writers for the duration of the split.
+	// As the index grows the ranges are recomputed while the writers are
+	// idle. The DB is locked for writing (readers wait) until finish(),
+	// which checkpoints it (the inserts are not logged).
+	class ShardedWriter {
+	public:
+		ShardedWriter(DNS_DB * dbref, int nshards = WRITER_SHARDS);
+		~ShardedWriter();
+
+		queryError addDomain(const std::string & domain);
+		queryError addIDomain(const char * domint);
+		void finish();
+
+		unsigned long getNumAdded() const { return num_added; }
+		unsigned long getNumDuplicated() const { return num_dups; }
+		unsigned int getNumPartitions() const { return num_partitions; }
+
+	private:
+		class Shard {
+		public:
+			Shard() : queue(WRITER_QUEUE_SIZE) {}
+			BoundedQueue < std::vector <char> > queue;
+			std::vector <char> pending;   // Batch being filled
+			std::thread thread;
+		};
+
+		void writer(Shard * s);
+		void dispatch(Shard * s);
+		void waitIdle();
+		void partition();
+		int route(const char * domint) const;
+
+		DNS_DB * db;
+		std::vector < std::unique_ptr<Shard> > shards;
+		std::vector <char> bounds;          // First key of each active shard
+		unsigned int nactive;               // Shards with a key range
+		unsigned int split_mark;            // Splits at the last partition
+		int nodes_mark;                     // Nodes at the last partition
+		std::mutex idle_lock;
+		std::condition_variable idle;
+		unsigned int inflight;              // Batches queued or being inserted
+		std::atomic <unsigned long> num_added, num_dups;
+		unsigned int num_partitions;
+		bool finished;
+	};
 
 private:
 	// Iterators, save them here to track DB updates
 	std::vector <DomainIterator*> iterators;
-};
+	std::mutex iterators_lock;
 
+	// Readers share it, modifiers hold it exclusively
+	mutable RWLock dblock;
+};
 
+#endif
 
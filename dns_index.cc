@@ -12,75 +12,146 @@
 
 /** DnsIndex */
 
+// The index file holds the node B+tree pages (see node_tree.cc), which are
+// used straight from the mapping. Older index files (previous versions of
+// the pages format or the original one: 4 byte number of nodes followed by
+// the nodes and, for DBs using the segment storage, the block -> extent
+// table: magic, size, table) are converted on open.
+//
+// Each node also has the counters of its block, which are updated after
+// every change to the block, so the DB totals only need the index. They
+// are recounted from the blocks if the index was not closed cleanly.
+//
+// The blocks referenced by the last checkpoint copy of the index (see
+// wal.cc) get a private view on their first change after it, the ones
+// created since (fresh) are changed in place. Block IDs are given out
+// again once their blocks are freed (merged blocks, after the next
+// checkpoint), so the filters and the segment table, sized by the
+// highest ID, do not grow past the number of blocks in use.
+
+#define SEGMENT_TABLE_MAGIC   0x54474553   // "SEGT"
+
 int DNS_DB::DnsIndex::lookupNode(const char * domain) const {
 	// Look for node which potentially has this domain
-	int first = 0, last = nodes.size()-1;
-	while (first <= last) {
-		int middle = (first+last)>>1;
-		const Node * n = &nodes[middle];
-		if ( less_eq(n->min, domain) && less(domain, n->max) )
-			return middle;
-		else if less_eq(domain, n->min)
-			last = middle - 1;
-		else
-			first = middle + 1;
-	}
-	assert(0 && "This should never occur\n");
-	return -1;
+	int n = nodes.find(domain);
+	assert(less_eq(nodes[n].min, domain) && less(domain, nodes[n].max) && "This should never occur\n");
+	return n;
 }
 
 DNS_DB::DnsIndex::DnsIndex(DNS_DB * db) : database(db) {
 	Node n;
+	memset(&n, 0, sizeof(n));
 	n.dnsblock_id = 0;
 	memset(n.min, 0, sizeof(n.min));
 	memset(n.max,~0, sizeof(n.min));
-	nodes.push_back(n);
+	nodes.insert(n);
 	current_id = 1;
+	num_splits = 0;
+	merge_cursor = 0;
 }
 
-void DNS_DB::DnsIndex::serialize(std::string file) {
-	// Write to file
-	FILE * fd = fopen(file.c_str(),"wb");
-	uint32_t s = nodes.size();
-	fwrite(&s, 1, 4, fd);
-	for (unsigned int i = 0; i < nodes.size(); i++) {
-		fwrite(&nodes[i], 1, MAX_DNS_SIZE*2 + 4, fd);
-	}
-	fclose(fd);
+void DNS_DB::DnsIndex::sync() {
+	nodes.sync(current_id);
 }
 
-void DNS_DB::DnsIndex::unserialize(const std::string & file) {
-	// Read from file
+// Returns whether the index was closed cleanly
+bool DNS_DB::DnsIndex::open(const std::string & file) {
+	if (nodes.open(file, &current_id)) {
+		findFreeIds();
+		return nodes.wasClean();
+	}
+
+	std::vector <Node> sorted;
 	if (!FileMapper::getInstance().fileExists(file)) {
 		fprintf(stderr,"Warning: Could not read DB index!\n");
-		return;
 	}
+	else if (!NodeTree::readOld(file, sorted)) {
+		// Very old format, load it and write it back in the new one
+		void * fptr = FileMapper::getInstance().mapFile(file);
+
+		uint32_t nblks = *(uint32_t*)fptr;
+		char * cptr = (char*)fptr;
+		cptr += 4;
+
+		// Nodes are stored sorted
+		sorted.resize(nblks);
+		for (unsigned int i = 0; i < nblks; i++) {
+			memset(&sorted[i], 0, sizeof(Node));
+			memcpy(&sorted[i], cptr, MAX_DNS_SIZE*2 + 4);
+			cptr += MAX_DNS_SIZE*2 + 4;
+		}
 
-	// Discard our own index
-	nodes.clear();
+		// Optional segment table after the nodes, it now has its own file
+		char * eptr = (char*)fptr + FileMapper::getInstance().getSize(fptr);
+		if (cptr + 8 <= eptr && ((uint32_t*)cptr)[0] == SEGMENT_TABLE_MAGIC) {
+			uint32_t n = ((uint32_t*)cptr)[1];
+			uint32_t * table = (uint32_t*)(cptr + 8);
+			assert((char*)&table[n] <= eptr);
+			database->segments.setTable(database->db_path, std::vector <uint32_t> (table, table + n));
+			database->segments.save();
+		}
+		FileMapper::getInstance().unmap(fptr);
+	}
 
-	void * fptr = FileMapper::getInstance().mapFile(file);
+	if (!sorted.empty()) {
+		// Replace our own index
+		nodes.build(sorted);
 
-	uint32_t nblks = *(uint32_t*)fptr;
-	char * cptr = (char*)fptr;
-	cptr += 4;
+		// Find the biggest id
+		current_id = 0;
+		for (unsigned i = 0; i < sorted.size(); i++)
+			if (sorted[i].dnsblock_id > current_id)
+				current_id = sorted[i].dnsblock_id;
+		current_id++;
 
-	for (unsigned int i = 0; i < nblks; i++) {
-		Node * nodeptr = (Node*)cptr;
-		nodes.push_back(*nodeptr);
-		cptr += MAX_DNS_SIZE*2 + 4;
+		// Old formats had no counters, get them from the blocks (once)
+		for (unsigned int i = 0; i < nodes.size(); i++)
+			updateCounts(i, getBlock(i));
 	}
-	FileMapper::getInstance().unmap(fptr);
 
-	// Find the biggest id
-	current_id = 0;
-	for (unsigned i = 0; i < nodes.size(); i++)
-		if (nodes[i].dnsblock_id > current_id)
-			current_id = nodes[i].dnsblock_id;
-	current_id++;
+	if (!nodes.save(file, current_id)) {
+		fprintf(stderr, "Could not write DB index %s!\n", file.c_str());
+		exit(1);
+	}
+	findFreeIds();
+	return true;
+}
+
+// The IDs below the highest one which no node has, the blocks freed
+void DNS_DB::DnsIndex::findFreeIds() {
+	std::vector <bool> inuse(current_id);
+	nodes.scan([&inuse](const Node & n) { inuse[n.dnsblock_id] = true; });
+
+	// Lowest ones first
+	free_ids.clear();
+	for (unsigned int id = current_id; id-- > 0; )
+		if (!inuse[id])
+			free_ids.push_back(id);
+	fresh.assign(current_id, false);
+}
+
+// The blocks are synced, none is fresh anymore
+void DNS_DB::DnsIndex::checkpoint(const std::string & file, uint64_t lsn) {
+	if (!nodes.write(file, current_id, lsn)) {
+		fprintf(stderr, "Could not write DB index checkpoint %s!\n", file.c_str());
+		exit(1);
+	}
+	fresh.assign(current_id, false);
+}
+
+uint64_t DNS_DB::DnsIndex::restore(const std::string & file, const std::string & index) {
+	uint32_t next_id;
+	if (!nodes.open(file, &next_id) || !nodes.save(index, next_id)) {
+		fprintf(stderr, "Could not restore DB index checkpoint %s!\n", file.c_str());
+		exit(1);
+	}
+	return nodes.getLsn();
 }
 
 void DNS_DB::DnsIndex::check() {
+	if (!nodes.verify())
+		fprintf(stderr, "DB index tree error!!!\n");
+
 	// Check consistency
 	for (unsigned int i = 0; i < nodes.size(); i++) {
 		if (!less(nodes[i].min, nodes[i].max)) {
@@ -120,8 +191,21 @@ void DNS_DB::DnsIndex::replaceIpv4(const char * domain, const IPv4_Record & oldr
 	}
 
 	int n = lookupNode(domint);
-	DNS_DB::DnsBlockPtr blk = database->getBlock(nodes[n].dnsblock_id);
-	blk->replaceDomainIpv4(domint, oldrec, newrec);
+	DNS_DB::DnsBlockPtr blk = writeBlock(n);
+	if (!blk->replaceDomainIpv4(domint, oldrec, newrec) || oldrec.ip == newrec.ip)
+		return;
+	updateCounts(n, blk);
+
+	database->ipbloom.add(blk->getID(), newrec.ip);
+
+	// Keep the reverse index in sync, the old IP might still be in use by another record
+	bool inuse = false;
+	std::vector <IPv4_Record> recs = blk->getDomainIpsv4(domint);
+	for (unsigned int i = 0; i < recs.size(); i++)
+		inuse = inuse || (recs[i].ip == oldrec.ip);
+	if (!inuse)
+		database->ipindex.remove(oldrec.ip, domint);
+	database->ipindex.add(newrec.ip, domint);
 }
 
 void DNS_DB::DnsIndex::addIp4Record(const char * domain, const IPv4_Record & record) {
@@ -132,32 +216,145 @@ void DNS_DB::DnsIndex::addIp4Record(const char * domain, const IPv4_Record & rec
 	}
 
 	int n = lookupNode(domint);
-	DNS_DB::DnsBlockPtr blk = database->getBlock(nodes[n].dnsblock_id);
+	DNS_DB::DnsBlockPtr blk = writeBlock(n);
 
-	if (!blk->addDomainIpv4(domint, record)) {
+	bool r = blk->addDomainIpv4(domint, record);
+	if (!r && blk->getNumDeleted() > 0) {
+		// Reclaiming the tombstones might be enough
+		compactNode(n);
+		r = blk->addDomainIpv4(domint, record);
+	}
+	if (!r) {
 		// Ops, just split the Block in two, must be full
-		unsigned int nwblk_id = this->current_id++;
-		DnsBlockPtr newblk = database->getBlock(nwblk_id);
-		blk->splitBlock(domint, newblk);
-
-		char nodemax[MAX_DNS_SIZE];
-		char dommax [MAX_DNS_SIZE];
-		getBlkMax(n, nodemax);
-		newblk->getMinDomain(dommax);
-
-		// Set new block boundaries
-		addBlock(nwblk_id, dommax, nodemax);
-
-		// Just recalculate the max for the other block
-		setBlkMinMax(n, 0, dommax);
+		splitNode(n);
 
 		// Redo
 		n = lookupNode(domint);
-		blk = database->getBlock(nodes[n].dnsblock_id);
+		blk = writeBlock(n);
 
-		bool r = blk->addDomainIpv4(domint, record);
+		r = blk->addDomainIpv4(domint, record);
 		assert(r);
 	}
+
+	if (r) {
+		updateCounts(n, blk);
+		database->ipindex.add(record.ip, domint);
+		database->ipbloom.add(blk->getID(), record.ip);
+	}
+}
+
+// Splits the block of node n in two, adding the new node to the index
+void DNS_DB::DnsIndex::splitNode(int n) {
+	DNS_DB::DnsBlockPtr blk = writeBlock(n);
+	DnsBlockPtr newblk = newBlock();
+	unsigned int nwblk_id = newblk->getID();
+	blk->splitBlock(newblk);
+
+	char nodemax[MAX_DNS_SIZE];
+	char dommax [MAX_DNS_SIZE];
+	getBlkMax(n, nodemax);
+	newblk->getMinDomain(dommax);
+
+	// Set new block boundaries
+	int nw = addBlock(nwblk_id, dommax, nodemax);
+
+	// Just recalculate the max for the other block
+	setBlkMinMax(n, 0, dommax);
+	updateCounts(n, blk);
+	updateCounts(nw, newblk);
+
+	// IP records moved around
+	database->ipbloom.rebuild(blk);
+	database->ipbloom.rebuild(newblk);
+	database->dombloom.rebuild(blk);
+	database->dombloom.rebuild(newblk);
+	num_splits++;
+}
+
+// Tombstones the domain and drops its IPs from the reverse index. The
+// block is compacted once enough of its domains are deleted
+DNS_DB::queryError DNS_DB::DnsIndex::deleteIDomain(const char * domint) {
+	int n = lookupNode(domint);
+	if (!getBlock(n)->hasDomain(domint))
+		return resNotFound;
+	DNS_DB::DnsBlockPtr blk = writeBlock(n);
+
+	std::vector <IPv4_Record> ips;
+	blk->deleteDomain(domint, &ips);
+	for (unsigned int i = 0; i < ips.size(); i++)
+		database->ipindex.remove(ips[i].ip, domint);
+	updateCounts(n, blk);
+
+	if (blk->getNumDeleted() > COMPACT_TOMBSTONES * (blk->getNumDomains() + blk->getNumDeleted()))
+		compactNode(n);
+	return resOK;
+}
+
+// Compacts the block of node n, the filters still have the deleted
+// domains (and their IPs) so they are rebuilt. Returns the slots freed
+int DNS_DB::DnsIndex::compactNode(int n) {
+	DNS_DB::DnsBlockPtr blk = writeBlock(n);
+	bool tombstones = blk->getNumDeleted() > 0;
+	int freed = blk->compact();
+	updateCounts(n, blk);
+
+	if (tombstones) {
+		database->ipbloom.rebuild(blk);
+		database->dombloom.rebuild(blk);
+	}
+	return freed;
+}
+
+unsigned long DNS_DB::DnsIndex::compact() {
+	unsigned long freed = 0;
+	for (unsigned int i = 0; i < nodes.size(); i++) {
+		freed += compactNode(i);
+		database->limitChanged();
+	}
+	return freed;
+}
+
+// Merges the block of node n+1 into the one of node n if their records fit
+// in MERGE_MAX_FILL of a block. The range of n+1 goes to n and its block
+// is freed (by the next checkpoint)
+bool DNS_DB::DnsIndex::mergeNodes(int n) {
+	if (n+1 >= (int)nodes.size() || nodes[n].used + nodes[n+1].used > MERGE_MAX_FILL * DnsBlock::numBlocks)
+		return false;
+
+	DNS_DB::DnsBlockPtr blk = writeBlock(n);
+	unsigned int freed = nodes[n+1].dnsblock_id;
+	{
+		DNS_DB::DnsBlockPtr next = getBlock(n+1);
+		blk->mergeBlock(next.get());
+	}
+
+	char nodemax[MAX_DNS_SIZE];
+	getBlkMax(n+1, nodemax);
+	nodes.erase(n+1);
+	setBlkMinMax(n, 0, nodemax);
+	updateCounts(n, blk);
+
+	// The block has the records of both now
+	database->ipbloom.rebuild(blk);
+	database->dombloom.rebuild(blk);
+	database->retireBlock(freed);
+	return true;
+}
+
+// Looks at up to budget nodes, from where the last call stopped (wrapping
+// around), merging each one with the next while they fit. Only counters
+// are read for the nodes which are not merged. Returns the blocks freed
+unsigned int DNS_DB::DnsIndex::merge(unsigned int budget) {
+	unsigned int merged = 0;
+	for (unsigned int i = 0; i < budget && i < nodes.size(); i++) {
+		if (merge_cursor + 1 >= nodes.size())
+			merge_cursor = 0;
+		while (mergeNodes(merge_cursor))
+			merged++;
+		merge_cursor++;
+		database->limitChanged();
+	}
+	return merged;
 }
 
 bool DNS_DB::DnsIndex::hasDomain(const char * domain) {
@@ -166,9 +363,33 @@ bool DNS_DB::DnsIndex::hasDomain(const char * domain) {
 		return false;
 
 	int n = lookupNode(domint);
-	DNS_DB::DnsBlockPtr blk = database->getBlock(nodes[n].dnsblock_id);
-	
-	return blk->hasDomain(domint);
+	unsigned int id = nodes[n].dnsblock_id;
+	DomainBloomFilter & filter = database->dombloom;
+
+	// Most misses can be answered without touching the block
+	filter.lookups++;
+	if (!filter.mayContain(id, domint)) {
+		filter.negatives++;
+		return false;
+	}
+
+	DNS_DB::DnsBlockPtr blk = database->getBlock(id);
+	if (!filter.isValid(id))
+		filter.rebuild(blk);
+
+	bool r = blk->hasDomain(domint);
+	if (!r)
+		filter.false_positives++;
+	return r;
+}
+
+// Whether the domain exists, and its IPs
+bool DNS_DB::DnsIndex::getDomainIpsv4(const char * domint, std::vector <IPv4_Record> & ips) {
+	DNS_DB::DnsBlockPtr blk = getBlock(lookupNode(domint));
+	if (!blk->hasDomain(domint))
+		return false;
+	ips = blk->getDomainIpsv4(domint);
+	return true;
 }
 
 DNS_DB::queryError DNS_DB::DnsIndex::addDomain(const char * domain) {
@@ -176,45 +397,76 @@ DNS_DB::queryError DNS_DB::DnsIndex::addDomain(const char * domain) {
 	if (!domain2idom(domain, domint))
 		return resDomainTooLong;
 
+	return addIDomain(domint);
+}
+
+// Several writers can insert concurrently as long as they touch disjoint
+// sets of blocks (see ShardedWriter): they share the split lock while
+// inserting and only splits and private views (which modify the nodes
+// or the list of changed blocks) hold it exclusively
+DNS_DB::queryError DNS_DB::DnsIndex::addIDomain(const char * domint) {
+	queryError res;
+	{
+		ReadGuard g(split_lock);
+		int n = lookupNode(domint);
+		DNS_DB::DnsBlockPtr blk = database->getBlock(nodes[n].dnsblock_id);
+
+		res = isWritable(nodes[n].dnsblock_id, blk) ? blk->addDomain(domint) : resNoSpaceLeft;
+		if (res != resNoSpaceLeft) {
+			if (res == resOK) {
+				updateCounts(n, blk);
+				database->dombloom.add(blk->getID(), domint);
+			}
+			checkInsert(n, blk);
+			return res;
+		}
+	}
+
+	WriteGuard g(split_lock);
 	int n = lookupNode(domint);
-	DNS_DB::DnsBlockPtr blk = database->getBlock(nodes[n].dnsblock_id);
+	DNS_DB::DnsBlockPtr blk = writeBlock(n);
 
-	queryError res = blk->addDomain(domint);
+	// It might be a fresh copy, or reclaiming the tombstones might be enough
+	res = blk->addDomain(domint);
+	if (res == resNoSpaceLeft && blk->getNumDeleted() > 0) {
+		compactNode(n);
+		res = blk->addDomain(domint);
+	}
 
 	if (res == resNoSpaceLeft) {
 		// Ops, just split the Block in two, must be full
-		unsigned int nwblk_id = this->current_id++;
-		DnsBlockPtr newblk = database->getBlock(nwblk_id);
-		blk->splitBlock(domint, newblk);
-
-		char nodemax[MAX_DNS_SIZE];
-		char dommax [MAX_DNS_SIZE];
-		getBlkMax(n, nodemax);
-		newblk->getMinDomain(dommax);
-
-		// Set new block boundaries
-		addBlock(nwblk_id, dommax, nodemax);
-
-		// Just recalculate the max for the other block
-		setBlkMinMax(n, 0, dommax);
+		splitNode(n);
 
 		// Redo
 		n = lookupNode(domint);
-		blk = database->getBlock(nodes[n].dnsblock_id);
+		blk = writeBlock(n);
 
 		res = blk->addDomain(domint);
 		assert(res != resNoSpaceLeft);
 	}
 
+	if (res == resOK) {
+		updateCounts(n, blk);
+		database->dombloom.add(blk->getID(), domint);
+	}
+	checkInsert(n, blk);
+
+	return res;
+}
+
+void DNS_DB::DnsIndex::checkInsert(int n, const DnsBlockPtr & blk) {
 	// Make sure the blog minimum is consistent
 	#ifdef EXTRA_CHECK
+	DnsBlock::Iterator it = blk->getIterator(database, 0);
+	if (!it.valid())
+		return;
+
 	char tmpd[MAX_DNS_SIZE];
-	blk->getIterator(database, 0).getDomain(tmpd);
+	it.getDomain(tmpd);
 	assert(less_eq(nodes[n].min, tmpd));
 
 	// Make sure it is allright
 	char prev[MAX_DNS_SIZE] = {0};
-	DnsBlock::Iterator it = blk->getIterator(database, 0);
 	while (!it.end()) {
 		char curr[MAX_DNS_SIZE];
 		it.getDomain(curr);
@@ -222,14 +474,15 @@ DNS_DB::queryError DNS_DB::DnsIndex::addDomain(const char * domain) {
 		memcpy(prev,curr,MAX_DNS_SIZE);
 		it.next();
 	}
+	#else
+	(void)n;
+	(void)blk;
 	#endif
-
-	return res;
 }
 
 void DNS_DB::DnsIndex::setBlkMinMax(int n, const char * vmin, const char * vmax) {
-	if (vmin) memcpy(nodes[n].min, vmin, MAX_DNS_SIZE);
-	if (vmax) memcpy(nodes[n].max, vmax, MAX_DNS_SIZE);
+	if (vmin) nodes.setMin(n, vmin);
+	if (vmax) nodes.setMax(n, vmax);
 }
 void DNS_DB::DnsIndex::getBlkMax(int n, char * v) {
 	memcpy(v, nodes[n].max, MAX_DNS_SIZE);
@@ -241,37 +494,98 @@ void DNS_DB::DnsIndex::getBlkMin(int n, char * v) {
 
 int DNS_DB::DnsIndex::addBlock(unsigned int nwblk_id, const char * vmin, const char * vmax) {
 	DNS_DB::DnsIndex::Node node;
+	memset(&node, 0, sizeof(node));
 	node.dnsblock_id = nwblk_id;
 	memcpy(node.min, vmin, MAX_DNS_SIZE);
 	memcpy(node.max, vmax, MAX_DNS_SIZE);
-	nodes.push_back(node);
+	return nodes.insert(node);
+}
 
-	// Now sort all the nodes
-	std::sort(nodes.begin(), nodes.end(), DNS_DB::DnsIndex::Node::lessthan);
+// Appends a block at the end of the index (used by the bulk loader, which
+// generates the blocks in order). The previous last node is closed at vmin
+void DNS_DB::DnsIndex::appendBlock(unsigned int nwblk_id, const char * vmin) {
+	assert(less(nodes[nodes.size()-1].min, vmin));
+	nodes.setMax(nodes.size()-1, vmin);
 
-	for (unsigned int i = 0; i < nodes.size(); i++)
-		if (nodes[i].dnsblock_id == nwblk_id)
-			return i;
+	DNS_DB::DnsIndex::Node node;
+	memset(&node, 0, sizeof(node));
+	node.dnsblock_id = nwblk_id;
+	memcpy(node.min, vmin, MAX_DNS_SIZE);
+	memset(node.max, ~0, MAX_DNS_SIZE);
+	nodes.insert(node);
+}
 
-	assert(0 && "Should never reach this\n");
-	return 0;
+bool DNS_DB::DnsIndex::isEmpty() {
+	return nodes.size() == 1 && nodes[0].used == 0;
 }
 
+void DNS_DB::DnsIndex::updateCounts(int n, const DnsBlockPtr & blk) {
+	assert(nodes[n].dnsblock_id == (unsigned int)blk->getID());
+	nodes.setCounts(n, blk->getNumRecords(), blk->getNumDomains(), blk->getNumIps());
+}
 
-unsigned long DNS_DB::DnsIndex::getNumberRecords() {
-	unsigned long ret = 0;
+// The counters might be stale after a crash (those of the blocks too),
+// gets them from the block contents
+void DNS_DB::DnsIndex::recount() {
+	unsigned int fixed = 0;
 	for (unsigned int i = 0; i < nodes.size(); i++) {
-		ret += this->getBlock(nodes[i].dnsblock_id)->getNumRecords();
+		DnsBlockPtr blk = getBlock(i);
+		fixed += blk->recount();
+		updateCounts(i, blk);
+	}
+	if (fixed)
+		fprintf(stderr, "Warning: fixed the counters of %u blocks\n", fixed);
+}
+
+// The block of node n, ready to be modified
+DNS_DB::DnsBlockPtr DNS_DB::DnsIndex::writeBlock(int n) {
+	unsigned int id = nodes[n].dnsblock_id;
+	DnsBlockPtr blk = database->getBlock(id);
+	if (!isWritable(id, blk))
+		database->makePrivate(blk);
+	return blk;
+}
+
+// The ID might have been used before a crash (see DNS_DB::newBlock)
+DNS_DB::DnsBlockPtr DNS_DB::DnsIndex::newBlock() {
+	unsigned int id = current_id;
+	if (free_ids.empty())
+		current_id++;
+	else {
+		id = free_ids.back();
+		free_ids.pop_back();
 	}
+	fresh.resize(current_id);
+	fresh[id] = true;
+	return database->newBlock(id);
+}
+
+
+void DNS_DB::DnsIndex::scanIpsv4(const IpCallback & cb) {
+	for (unsigned int i = 0; i < nodes.size(); i++)
+		this->getBlock(i)->scanIpsv4(cb);
+}
+
+unsigned long DNS_DB::DnsIndex::getNumberRecords() {
+	unsigned long ret = 0;
+	nodes.scan([&ret](const Node & n) { ret += n.used; });
 	return ret;
 }
 
 unsigned long DNS_DB::DnsIndex::getNumberFreeRecords() {
 	unsigned long ret = 0;
-	for (unsigned int i = 0; i < nodes.size(); i++) {
-		ret += this->getBlock(nodes[i].dnsblock_id)->getNumFreeRecords();
-	}
+	nodes.scan([&ret](const Node & n) { ret += DnsBlock::numBlocks - n.used; });
 	return ret;
 }
 
+unsigned long DNS_DB::DnsIndex::getNumberDomains() {
+	unsigned long ret = 0;
+	nodes.scan([&ret](const Node & n) { ret += n.domains; });
+	return ret;
+}
 
+unsigned long DNS_DB::DnsIndex::getNumberIps() {
+	unsigned long ret = 0;
+	nodes.scan([&ret](const Node & n) { ret += n.ips; });
+	return ret;
+}
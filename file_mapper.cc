@@ -24,84 +24,94 @@ unsigned int fileSize(int fd) {
 /** File Mapper */
 #define MAX_MAPPED   (MAX_MEMMAPPED_MEMORY_MB*1024*1024)
 
+DNS_DB::FileMapper::MappedFile * DNS_DB::FileMapper::lookup(void * ptr) const {
+	std::unordered_map <void*, MappedFile*>::const_iterator it = mappings.find(ptr);
+	return it == mappings.end() ? 0 : it->second;
+}
+
+// Cached list: mappings with no references, kept in LRU order
+void DNS_DB::FileMapper::cacheUnlink(MappedFile * f) {
+	if (f->prev) f->prev->next = f->next;
+	else cached_head = f->next;
+	if (f->next) f->next->prev = f->prev;
+	else cached_tail = f->prev;
+	f->prev = f->next = 0;
+}
+
+void DNS_DB::FileMapper::cacheAppend(MappedFile * f) {
+	f->prev = cached_tail;
+	f->next = 0;
+	if (cached_tail) cached_tail->next = f;
+	else cached_head = f;
+	cached_tail = f;
+}
+
+void DNS_DB::FileMapper::addRef(MappedFile * f) {
+	if (f->refs++ == 0) {
+		cacheUnlink(f);
+		mapped_cached -= f->size;
+		mapped_referenced += f->size;
+	}
+}
+
 void * DNS_DB::FileMapper::mapFile(const std::string & file) {
+	std::lock_guard <std::mutex> g(lock);
+
 	// First of all look whether we have this mapping cached
-	for (unsigned int i = 0; i < files.size(); i++) {
-		if (files[i].file == file) {
-			files[i].refs++;
-			return files[i].ptr;
-		}
+	std::unordered_map <std::string, MappedFile>::iterator it = files.find(file);
+	if (it != files.end()) {
+		addRef(&it->second);
+		return it->second.ptr;
 	}
 
 	// Free some memory
 	flushCached();
 
 	// Create a new mapping
-	MappedFile f;
+	MappedFile & f = files[file];
 	f.refs = 1;
 	f.file = file;
 	f.fd = open(file.c_str(), O_RDWR);
 	f.size = fileSize(f.fd);
 	f.ptr = mmap(0, f.size, PROT_READ|PROT_WRITE, MAP_SHARED, f.fd, 0);
+	f.prev = f.next = 0;
 
 	assert(f.fd >= 0);
 	assert(f.ptr != 0);
 
-	files.push_back(f);
+	mappings[f.ptr] = &f;
+	mapped_referenced += f.size;
 
 	return f.ptr;
 }
 
 void DNS_DB::FileMapper::unmap(void * ptr) {
-	//std::cout << "File mapper debug dump" << std::endl;
-	//for (unsigned int i = 0; i < files.size(); i++)
-	//	std::cout << files[i].file << " " << files[i].refs << std::endl;
-	
-	for (unsigned int i = 0; i < files.size(); i++) {
-		if (files[i].ptr == ptr) {
-			files[i].refs--;
-			return;
-		}
+	std::lock_guard <std::mutex> g(lock);
+	MappedFile * f = lookup(ptr);
+	assert(f && "Couldn't find the mapped file! This should never happen\n");
+
+	if (--f->refs == 0) {
+		cacheAppend(f);
+		mapped_referenced -= f->size;
+		mapped_cached += f->size;
 	}
-	assert(0 && "Couldn't find the mapped file! This should never happen\n");
 }
 
 void DNS_DB::FileMapper::flushCached() {
-	// Calculate the size of mapped stuff
-	int mapped_referenced = 0;
-	int mapped_cached = 0;
-
-	for (unsigned int i = 0; i < files.size(); i++) {
-		if (files[i].refs > 0)
-			mapped_referenced += files[i].size;
-		else
-			mapped_cached += files[i].size;
-	}
-
 	// Free until we get under the maximum or until no cached stuff is mapped
-	while (mapped_referenced + mapped_cached > MAX_MAPPED && mapped_cached > 0) {
-		// Look for a victim
-		for (unsigned int i = 0; i < files.size(); i++) {
-			if (files[i].refs == 0) {
-				mapped_cached -= files[i].size;
-				this->deallocate(i);
-				break;
-			}
-		}
-	}
+	// Victims are taken from the head of the cached list (least recently used)
+	while (mapped_referenced + mapped_cached > MAX_MAPPED && cached_head)
+		this->deallocate(cached_head);
 }
 
 void DNS_DB::FileMapper::flush(void * ptr) {
-	for (unsigned int i = 0; i < files.size(); i++) {
-		if (files[i].ptr == ptr) {
-			msync(files[i].ptr, files[i].size, MS_SYNC);
-			return;
-		}
-	}
+	std::lock_guard <std::mutex> g(lock);
+	MappedFile * f = lookup(ptr);
+	if (f)
+		msync(f->ptr, f->size, MS_SYNC);
 }
 
-void DNS_DB::FileMapper::deallocate(int p) {
-	MappedFile * f = &files[p];
+void DNS_DB::FileMapper::deallocate(MappedFile * f) {
 	// Unmap and free
 	assert(f->refs == 0);
 	if (munmap(f->ptr, f->size) < 0)
@@ -109,7 +119,10 @@ void DNS_DB::FileMapper::deallocate(int p) {
 	if (close(f->fd) < 0)
 		fprintf(stderr, "Could not close file!\n");
 
-	files.erase(files.begin() + p);
+	cacheUnlink(f);
+	mapped_cached -= f->size;
+	mappings.erase(f->ptr);
+	files.erase(f->file);
 }
 
 bool DNS_DB::FileMapper::fileExists(const std::string & file) const {
@@ -126,25 +139,62 @@ void DNS_DB::FileMapper::createFile(const std::string & file, int size) const {
 	close(fd);
 }
 
-void DNS_DB::FileMapper::refinc(void * ptr) {
-	for (unsigned int i = 0; i < files.size(); i++) {
-		if (files[i].ptr == ptr) {
-			files[i].refs++;
-			return;
-		}
-	}
-	assert(0 && "Couldn't find the mapped pointer! This should never happen\n");
+// Deletes the file, dropping its mapping unless it is still in use
+void DNS_DB::FileMapper::removeFile(const std::string & file) {
+	std::lock_guard <std::mutex> g(lock);
+	std::unordered_map <std::string, MappedFile>::iterator it = files.find(file);
+	if (it != files.end() && it->second.refs == 0)
+		deallocate(&it->second);
+	if (unlink(file.c_str()) < 0)
+		fprintf(stderr, "Could not remove %s!\n", file.c_str());
 }
 
-int DNS_DB::FileMapper::getRefs(void * ptr) const {
-	for (unsigned int i = 0; i < files.size(); i++) {
-		if (files[i].ptr == ptr) {
-			return files[i].refs;
-		}
+// Grows the file to size bytes (zero filled) if it is smaller
+void DNS_DB::FileMapper::extendFile(const std::string & file, int size) const {
+	int fd = open(file.c_str(), O_RDWR);
+	if (fd < 0)
+		return;
+	if (fileSize(fd) < (unsigned int)size)
+		fallocate(fd, 0, 0, size);
+	close(fd);
+}
+
+// Copy on write mapping of part of a file, what is written to it never
+// goes to the file. Not cached, nor counted as mapped memory
+void * DNS_DB::FileMapper::mapPrivate(const std::string & file, unsigned long offset, unsigned long size) const {
+	int fd = open(file.c_str(), O_RDONLY);
+	void * ptr = fd < 0 ? MAP_FAILED : mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, offset);
+	if (ptr == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s!\n", file.c_str());
+		exit(1);
 	}
-	assert(0 && "Couldn't find the mapped pointer! This should never happen\n");
-	return -1;
+	close(fd);
+	return ptr;
 }
 
+void DNS_DB::FileMapper::unmapPrivate(void * ptr, unsigned long size) const {
+	if (munmap(ptr, size) < 0)
+		fprintf(stderr, "Could not unmap file!\n");
+}
 
+void DNS_DB::FileMapper::refinc(void * ptr) {
+	std::lock_guard <std::mutex> g(lock);
+	MappedFile * f = lookup(ptr);
+	assert(f && "Couldn't find the mapped pointer! This should never happen\n");
+	addRef(f);
+}
+
+int DNS_DB::FileMapper::getRefs(void * ptr) const {
+	std::lock_guard <std::mutex> g(lock);
+	MappedFile * f = lookup(ptr);
+	assert(f && "Couldn't find the mapped pointer! This should never happen\n");
+	return f ? f->refs : -1;
+}
+
+int DNS_DB::FileMapper::getSize(void * ptr) const {
+	std::lock_guard <std::mutex> g(lock);
+	MappedFile * f = lookup(ptr);
+	assert(f && "Couldn't find the mapped pointer! This should never happen\n");
+	return f ? f->size : 0;
+}
 
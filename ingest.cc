@@ -0,0 +1,148 @@
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <gzstream.h>
+#include "ingest.h"
+
+static unsigned long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+IngestPipeline::IngestPipeline(const std::string & file, int parsers) :
+	file(file), num_parsers(parsers < 1 ? 1 : parsers),
+	chunks(INGEST_QUEUE_SIZE), batches(INGEST_QUEUE_SIZE),
+	parsers_running(0), invalid(0), stopped(false), wall(0),
+	st_inflate("inflate"), st_parse("parse"), st_insert("insert") {}
+
+// Reads the input in chunks of INGEST_CHUNK_SIZE, cut at the last whitespace
+// so no domain is split across chunks
+void IngestPipeline::decompress() {
+	igzstream fin (file.c_str());
+	std::vector <char> carry;
+	while (!stopped) {
+		unsigned long t0 = now_ns();
+		Chunk c;
+		c.data.swap(carry);
+		unsigned int off = c.data.size();
+		c.data.resize(off + INGEST_CHUNK_SIZE);
+		fin.read(&c.data[off], INGEST_CHUNK_SIZE);
+		unsigned int got = fin.gcount();
+		c.data.resize(off + got);
+
+		bool eof = (got < INGEST_CHUNK_SIZE);
+		if (!eof) {
+			int i = c.data.size() - 1;
+			while (i >= 0 && !isspace((unsigned char)c.data[i]))
+				i--;
+			carry.assign(c.data.begin() + i + 1, c.data.end());
+			c.data.resize(i + 1);
+		}
+
+		st_inflate.items++;
+		st_inflate.bytes += c.data.size();
+		st_inflate.busy_ns += now_ns() - t0;
+
+		if (!c.data.empty() && !chunks.push(std::move(c)))
+			break;
+		if (eof)
+			break;
+	}
+	chunks.close();
+}
+
+void IngestPipeline::parse() {
+	Chunk c;
+	while (chunks.pop(c)) {
+		unsigned long t0 = now_ns();
+		KeyBatch b;
+		b.keys.reserve(c.data.size() * 3);
+
+		char tok[256];
+		unsigned int len = 0, p = 0, n = 0;
+		while (p <= c.data.size()) {
+			if (p == c.data.size() || isspace((unsigned char)c.data[p])) {
+				if (len > 0) {
+					char domint[MAX_DNS_SIZE];
+					tok[len < sizeof(tok) ? len : sizeof(tok)-1] = 0;
+					if (len < sizeof(tok) && domain2idom(tok, domint)) {
+						b.keys.insert(b.keys.end(), domint, domint + MAX_DNS_SIZE);
+						n++;
+					}
+					else
+						invalid++;
+				}
+				len = 0;
+			}
+			else {
+				if (len < sizeof(tok))
+					tok[len] = c.data[p];
+				len++;
+			}
+			p++;
+		}
+
+		st_parse.items += n;
+		st_parse.bytes += c.data.size();
+		st_parse.busy_ns += now_ns() - t0;
+
+		if (!batches.push(std::move(b)))
+			break;
+	}
+	if (--parsers_running == 0)
+		batches.close();
+}
+
+void IngestPipeline::run(Sink sink) {
+	unsigned long t0 = now_ns();
+	parsers_running = num_parsers;
+
+	std::vector <std::thread> threads;
+	threads.push_back(std::thread(&IngestPipeline::decompress, this));
+	for (int i = 0; i < num_parsers; i++)
+		threads.push_back(std::thread(&IngestPipeline::parse, this));
+
+	KeyBatch b;
+	while (!stopped && batches.pop(b)) {
+		unsigned long t1 = now_ns();
+		unsigned int n = b.keys.size() / MAX_DNS_SIZE;
+		for (unsigned int i = 0; i < n; i++) {
+			if (!sink(&b.keys[i*MAX_DNS_SIZE])) {
+				stopped = true;
+				break;
+			}
+			st_insert.items++;
+		}
+		st_insert.bytes += b.keys.size();
+		st_insert.busy_ns += now_ns() - t1;
+	}
+
+	// Unblock the producers in case we stopped early
+	chunks.close();
+	batches.close();
+	for (unsigned int i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	wall = (now_ns() - t0) / 1e9;
+}
+
+void IngestPipeline::report() const {
+	const StageStats * st[3] = { &st_inflate, &st_parse, &st_insert };
+	const char * units[3] = { "chunks", "domains", "domains" };
+
+	fprintf(stderr, "Ingestion took %.2fs (%d parser threads, %lu invalid)\n", wall, num_parsers, (unsigned long)invalid);
+	for (int i = 0; i < 3; i++) {
+		double busy = st[i]->busy_ns / 1e9;
+		fprintf(stderr, "  %-8s %10lu %-7s %8.1f MB  busy %7.2fs  %9.0f %s/s  %7.1f MB/s\n",
+			st[i]->name, (unsigned long)st[i]->items, units[i], st[i]->bytes / 1048576.0, busy,
+			busy > 0 ? st[i]->items / busy : 0, units[i],
+			busy > 0 ? st[i]->bytes / 1048576.0 / busy : 0);
+	}
+}
+
@@ -0,0 +1,68 @@
+
+#ifndef INGEST__H__
+#define INGEST__H__
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include "queue.h"
+#include "dns_db.h"
+
+/**
+ * Pipelined domain ingestion
+ *
+ * Three stages connected by bounded queues:
+ *
+ *  - Decompress: inflates the (gzipped) input in chunks cut at whitespace
+ *  - Parse: tokenizes the chunks and converts the domains to internal
+ *    keys (MAX_DNS_SIZE bytes each), in batches
+ *  - Insert: runs on the calling thread, hands each key to the sink
+ *
+**/
+
+class IngestPipeline {
+public:
+	// Returns false to stop the ingestion
+	typedef std::function<bool(const char * domint)> Sink;
+
+	IngestPipeline(const std::string & file, int parsers = INGEST_PARSER_THREADS);
+
+	void run(Sink sink);
+	void stop() { stopped = true; }
+	void report() const;
+
+	unsigned long getNumInvalid() const { return invalid; }
+
+private:
+	struct Chunk {
+		std::vector <char> data;
+	};
+	struct KeyBatch {
+		std::vector <char> keys;
+	};
+
+	class StageStats {
+	public:
+		StageStats(const char * n) : name(n), items(0), bytes(0), busy_ns(0) {}
+		const char * name;
+		std::atomic <unsigned long> items, bytes, busy_ns;
+	};
+
+	void decompress();
+	void parse();
+
+	std::string file;
+	int num_parsers;
+	BoundedQueue <Chunk> chunks;
+	BoundedQueue <KeyBatch> batches;
+	std::atomic <int> parsers_running;
+	std::atomic <unsigned long> invalid;
+	volatile bool stopped;
+	double wall;
+
+	StageStats st_inflate, st_parse, st_insert;
+};
+
+#endif
+
@@ -0,0 +1,200 @@
+
+#include <string>
+#include <algorithm>
+#include <string.h>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "dns_db.h"
+
+/** IP reverse index */
+
+// File format: 4 byte magic, 4 byte number of entries and then the entries
+// sorted by IP and domain (packed, 4 byte IP + internal domain)
+
+#define IPINDEX_MAGIC   0x31504449   // "IDP1"
+#define IPINDEX_HEADER  8
+
+DNS_DB::IpIndex::~IpIndex() {
+	unmapBase();
+}
+
+bool DNS_DB::IpIndex::load(const std::string & file) {
+	this->file = file;
+	unmapBase();
+	added.clear();
+	removed.clear();
+
+	if (!FileMapper::getInstance().fileExists(file))
+		return false;
+
+	mapBase();
+	return true;
+}
+
+void DNS_DB::IpIndex::mapBase() {
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	base_size = lseek(fd, 0, SEEK_END);
+	if (base_size >= IPINDEX_HEADER)
+		base = mmap(0, base_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED || base == 0 || ((uint32_t*)base)[0] != IPINDEX_MAGIC) {
+		fprintf(stderr, "Warning: Could not read IP index!\n");
+		if (base != MAP_FAILED && base != 0)
+			munmap(base, base_size);
+		base = 0;
+		base_size = 0;
+		nentries = 0;
+		return;
+	}
+	nentries = ((uint32_t*)base)[1];
+	assert(IPINDEX_HEADER + nentries*sizeof(Entry) <= base_size);
+}
+
+void DNS_DB::IpIndex::unmapBase() {
+	if (base)
+		munmap(base, base_size);
+	base = 0;
+	base_size = 0;
+	nentries = 0;
+}
+
+const DNS_DB::IpIndex::Entry * DNS_DB::IpIndex::lowerBound(IPv4 ip) const {
+	const Entry * entries = (const Entry *)((char*)base + IPINDEX_HEADER);
+	unsigned int first = 0, last = nentries;
+	while (first < last) {
+		unsigned int middle = (first+last)>>1;
+		if (entries[middle].ip < ip)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+	return &entries[first];
+}
+
+void DNS_DB::IpIndex::add(IPv4 ip, const char * domint) {
+	Entry e;
+	e.ip = ip;
+	memcpy(e.domain, domint, MAX_DNS_SIZE);
+
+	if (removed.erase(e) == 0)
+		added.insert(e);
+
+	if (added.size() + removed.size() > IPINDEX_DELTA_MAX)
+		save();
+}
+
+void DNS_DB::IpIndex::remove(IPv4 ip, const char * domint) {
+	Entry e;
+	e.ip = ip;
+	memcpy(e.domain, domint, MAX_DNS_SIZE);
+
+	if (added.erase(e) == 0)
+		removed.insert(e);
+
+	if (added.size() + removed.size() > IPINDEX_DELTA_MAX)
+		save();
+}
+
+// Returns all the entries with an IP in the ip/prefixlen network, sorted
+std::vector <DNS_DB::IpIndex::Entry> DNS_DB::IpIndex::lookup(IPv4 ip, int prefixlen) const {
+	uint32_t mask = prefixlen <= 0 ? 0 : (~0U) << (32 - (prefixlen > 32 ? 32 : prefixlen));
+	uint64_t lo = ip & mask;
+	uint64_t hi = lo + (uint64_t)(~mask);
+
+	std::vector <Entry> ret;
+	if (base) {
+		const Entry * end = (const Entry *)((char*)base + IPINDEX_HEADER) + nentries;
+		for (const Entry * e = lowerBound(lo); e != end && e->ip <= hi; e++)
+			if (removed.find(*e) == removed.end())
+				ret.push_back(*e);
+	}
+
+	Entry k;
+	k.ip = lo;
+	memset(k.domain, 0, MAX_DNS_SIZE);
+	std::vector <Entry> delta;
+	for (std::set<Entry>::const_iterator it = added.lower_bound(k); it != added.end() && it->ip <= hi; ++it)
+		delta.push_back(*it);
+
+	if (!delta.empty()) {
+		std::vector <Entry> merged(ret.size() + delta.size());
+		std::merge(ret.begin(), ret.end(), delta.begin(), delta.end(), merged.begin());
+		ret.swap(merged);
+	}
+	return ret;
+}
+
+void DNS_DB::IpIndex::writeBase(const std::vector <Entry> & entries) {
+	std::string tmpfile = file + ".tmp";
+	FILE * fd = fopen(tmpfile.c_str(), "wb");
+	if (fd == NULL) {
+		fprintf(stderr, "Could not write IP index!\n");
+		return;
+	}
+	uint32_t hdr[2] = { IPINDEX_MAGIC, (uint32_t)entries.size() };
+	fwrite(hdr, 1, sizeof(hdr), fd);
+	if (!entries.empty())
+		fwrite(&entries[0], sizeof(Entry), entries.size(), fd);
+	fclose(fd);
+
+	unmapBase();
+	rename(tmpfile.c_str(), file.c_str());
+	mapBase();
+}
+
+// Merges the deltas into a new base file
+void DNS_DB::IpIndex::save() {
+	if (file.empty() || (base && added.empty() && removed.empty()))
+		return;
+
+	std::vector <Entry> entries;
+	entries.reserve(nentries + added.size());
+
+	const Entry * e = (const Entry *)((char*)base + IPINDEX_HEADER);
+	const Entry * end = base ? e + nentries : e;
+	std::set<Entry>::const_iterator it = added.begin();
+	while (e != end || it != added.end()) {
+		if (it == added.end() || (e != end && *e < *it)) {
+			if (removed.find(*e) == removed.end())
+				entries.push_back(*e);
+			e++;
+		}
+		else
+			entries.push_back(*it++);
+	}
+
+	added.clear();
+	removed.clear();
+	writeBase(entries);
+}
+
+// Scans the whole DB to regenerate the index
+void DNS_DB::IpIndex::rebuild(DnsIndex * idx) {
+	std::vector <Entry> entries;
+	idx->scanIpsv4([&](const char * domint, const IPv4_Record & rec) {
+		Entry e;
+		e.ip = rec.ip;
+		memcpy(e.domain, domint, MAX_DNS_SIZE);
+		entries.push_back(e);
+	});
+
+	std::sort(entries.begin(), entries.end());
+	entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry & a, const Entry & b) {
+		return a.ip == b.ip && eq(a.domain, b.domain);
+	}), entries.end());
+
+	added.clear();
+	removed.clear();
+	writeBase(entries);
+}
+
@@ -4,7 +4,9 @@
 #include <stdlib.h>
 #include <string>
 #include <signal.h>
+#include <arpa/inet.h>
 #include "dns_db.h"
+#include "ingest.h"
 
 
 bool doexit = false;
@@ -19,7 +21,17 @@ int main(int argc, char ** argv) {
 	if (argc < 4) {
 		fprintf(stderr, "Usage: %s dbpath command (args...)\n", argv[0]);
 		fprintf(stderr, " Commands:\n");
-		fprintf(stderr, "  * add-domains file\n");
+		fprintf(stderr, "  * create files|segments\n");
+		fprintf(stderr, "  * add-domains file [writers]\n");
+		fprintf(stderr, "  * bulk-add-domains file\n");
+		fprintf(stderr, "  * delete-domains file\n");
+		fprintf(stderr, "  * compact -\n");
+		fprintf(stderr, "  * list-domains -\n");
+		fprintf(stderr, "  * lookup-ip ip[/prefix]\n");
+		fprintf(stderr, "  * scan-ip ip\n");
+		fprintf(stderr, "  * rebuild-ipindex -\n");
+		fprintf(stderr, "  * summary -\n");
+		fprintf(stderr, "  * check -\n");
 		fprintf(stderr, "  * crawl bw(kbps)\n");
 		exit(0);
 	}
@@ -31,25 +43,82 @@ int main(int argc, char ** argv) {
 	std::string command = std::string(argv[2]);
 	std::string arg0    = std::string(argv[3]);
 
-	DNS_DB db(pathdb);
+	// Storage backend for new DBs
+	bool segmented = (command == "create" && arg0 == "segments");
+	DNS_DB db(pathdb, segmented);
 
 	std::vector <std::string> check;
 	
-	if (command == "add-domains") {
-		igzstream fin (arg0.c_str());
-		std::string domain;
-		while (fin >> domain && !doexit) {
-			DNS_DB::queryError r = db.addDomain(domain);
+	if (command == "create") {
+		std::cout << "Storage " << (db.isSegmented() ? "segments" : "files") << std::endl;
+	}
+	else if (command == "add-domains" && argc > 4 && atoi(argv[4]) > 1) {
+		// Parallel insertion, sharded by key range
+		IngestPipeline pipeline(arg0);
+		DNS_DB::ShardedWriter writer(&db, atoi(argv[4]));
+		pipeline.run([&](const char * domint) {
+			writer.addIDomain(domint);
+			return !doexit;
+		});
+		writer.finish();
+		pipeline.report();
+
+		std::cerr << "Added " << writer.getNumAdded() << " domains, " << writer.getNumDuplicated()
+			<< " duplicated, " << pipeline.getNumInvalid() << " invalid (" << writer.getNumPartitions() << " partitions)" << std::endl;
+	}
+	else if (command == "add-domains") {
+		IngestPipeline pipeline(arg0);
+		pipeline.run([&](const char * domint) {
+			DNS_DB::queryError r = db.addIDomain(domint);
+			(void)r;
 			#ifdef EXTRA_CHECK
-			assert(r == DNS_DB::resOK || r == DNS_DB::resAlreadyExists || r == DNS_DB::resDomainTooLong);
-			if (r == DNS_DB::resOK)
+			assert(r == DNS_DB::resOK || r == DNS_DB::resAlreadyExists);
+			if (r == DNS_DB::resOK) {
+				char domain[MAX_DNS_SIZE*2];
+				idom2domain(domint, domain);
 				check.push_back(domain);
+			}
 			#endif
-		}
+			return !doexit;
+		});
+		pipeline.report();
+		std::cerr << "Logged " << db.getLogRecords() << " changes in " << db.getLogCommits() << " commits" << std::endl;
 
 		for (unsigned int i = 0; i < check.size(); i++)
 			assert(db.hasDomain(check[i]));
 	}
+	else if (command == "bulk-add-domains") {
+		IngestPipeline pipeline(arg0);
+		DNS_DB::BulkLoader loader(&db);
+		pipeline.run([&](const char * domint) {
+			loader.addIDomain(domint);
+			return !doexit;
+		});
+		pipeline.report();
+		loader.finish();
+
+		std::cerr << "Added " << loader.getNumAdded() << " domains, " << loader.getNumDuplicated()
+			<< " duplicated, " << pipeline.getNumInvalid() << " invalid (" << loader.getNumRuns() << " sorted runs)" << std::endl;
+	}
+	else if (command == "delete-domains") {
+		IngestPipeline pipeline(arg0);
+		unsigned long deleted = 0, missing = 0;
+		pipeline.run([&](const char * domint) {
+			if (db.deleteIDomain(domint) == DNS_DB::resOK)
+				deleted++;
+			else
+				missing++;
+			return !doexit;
+		});
+		pipeline.report();
+
+		std::cerr << "Deleted " << deleted << " domains, " << missing << " not found, "
+			<< pipeline.getNumInvalid() << " invalid" << std::endl;
+	}
+	else if (command == "compact") {
+		std::cerr << "Freed " << db.compact() << " records" << std::endl;
+		std::cerr << "Merged " << db.mergeBlocks() << " blocks" << std::endl;
+	}
 	else if (command == "list-domains") {
 		DNS_DB::DomainIterator it = db.getDomainIterator();
 		while (!it.end()) {
@@ -61,12 +130,56 @@ int main(int argc, char ** argv) {
 			}
 		}
 	}
+	else if (command == "lookup-ip") {
+		int prefixlen = 32;
+		size_t slash = arg0.find('/');
+		if (slash != std::string::npos) {
+			prefixlen = atoi(arg0.substr(slash+1).c_str());
+			arg0 = arg0.substr(0, slash);
+		}
+		struct in_addr addr;
+		if (!inet_aton(arg0.c_str(), &addr) || prefixlen < 0 || prefixlen > 32) {
+			fprintf(stderr, "Invalid IP or network\n");
+			exit(1);
+		}
+
+		std::vector < std::pair<IPv4, std::string> > r = db.getDomainsByIpv4(ntohl(addr.s_addr), prefixlen);
+		for (unsigned int i = 0; i < r.size(); i++) {
+			addr.s_addr = htonl(r[i].first);
+			std::cout << inet_ntoa(addr) << " " << r[i].second << std::endl;
+		}
+	}
+	else if (command == "scan-ip") {
+		struct in_addr addr;
+		if (!inet_aton(arg0.c_str(), &addr)) {
+			fprintf(stderr, "Invalid IP\n");
+			exit(1);
+		}
+
+		unsigned int scanned;
+		std::vector < std::pair<IPv4, std::string> > r = db.scanDomainsByIpv4(ntohl(addr.s_addr), &scanned);
+		for (unsigned int i = 0; i < r.size(); i++)
+			std::cout << arg0 << " " << r[i].second << std::endl;
+		std::cerr << "Scanned " << scanned << " blocks" << std::endl;
+	}
+	else if (command == "rebuild-ipindex") {
+		db.rebuildIpIndex();
+	}
 	else if (command == "summary") {
 		int r = db.getNumberRecords();
 		int f = db.getNumberFreeRecords();
 		std::cout << "Total records " << r << std::endl;
 		std::cout << "Total free records " << f << std::endl;
 		std::cout << "Storage efficiency " << double(100*r)/(r+f) << std::endl;
+		std::cout << "Domains " << db.getNumberDomains() << std::endl;
+		std::cout << "IPv4 records " << db.getNumberIps() << std::endl;
+		std::cout << "Block cache hits " << db.getCacheHits() << " misses " << db.getCacheMisses()
+			<< " evictions " << db.getCacheEvictions() << std::endl;
+		std::cout << "Domain filter memory " << db.getDomainFilterMemory()/1024 << " KB" << std::endl;
+		std::cout << "Domain filter false positive rate " << 100*db.getDomainFilterFPRate() << "%" << std::endl;
+	}
+	else if (command == "check") {
+		// Reads all the blocks
 		db.check();
 	}
 	else if (command == "crawl") {
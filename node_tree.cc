@@ -0,0 +1,759 @@
+
+#include <string>
+#include <algorithm>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "dns_db.h"
+
+/** Index node B+tree */
+
+// Inner pages keep, for each child, its page number, the number of nodes
+// below it and its smallest key. Lookups by key pick the last child whose
+// key is <= the searched one, lookups by rank skip children by count.
+// Pages are split in half, except when appending past the last entry,
+// where the new page starts with just the new entry (so sequential loads
+// leave full pages behind).
+//
+// Each page also has the first 8 bytes of its keys as big endian integers,
+// so most comparisons during a search are integer ones on a small array.
+// Keys are zero padded, so comparing the prefixes and then the rest of
+// the keys gives the same order as comparing the whole keys.
+//
+// Index file format: a header page (FileHeader) followed by the pages, page
+// pid at offset (pid + 1) * INDEX_PAGE_SIZE. The file grows by doubling and
+// is mapped shared, so opening it only validates the header and updates
+// are done in place (the root, size and number of pages in the header are
+// kept up to date too). Pages carry a checksum which is refreshed (for the
+// modified pages only) by sync, at which point the header is marked clean
+// and gets its own checksum. A file which was not closed cleanly gets its
+// structure checked on open instead.
+//
+// Pages emptied by erase are kept in a free list (linked through their
+// first child, the head is in the header) and reused by newPage, so the
+// file does not grow with deletes. The list is rebuilt from the pages not
+// reachable from the root if the file was not closed cleanly.
+//
+// Checkpoint copies (see wal.cc) are index files too, with the sequence
+// number of the last logged change they have in the header.
+
+#define INDEX_MAGIC     0x58444e49   // "INDX"
+#define INDEX_VERSION   4
+
+// Version 2 had no free page list (the header ended at the checksum),
+// version 3 no sequence number
+#define V2_HEADER_SIZE  offsetof(FileHeader, free_head)
+#define V3_HEADER_SIZE  offsetof(FileHeader, lsn)
+
+// Version 1 had no counters in the nodes
+#define V1_NODE_SIZE    (MAX_DNS_SIZE*2 + 4)
+#define V1_LEAF_MAX     ((INDEX_PAGE_SIZE - 8) / (V1_NODE_SIZE + 8))
+
+static inline uint64_t key_prefix(const char * k) {
+	return key_word<MAX_DNS_SIZE>(k, 0);
+}
+
+// Whether (pa, a) <= (pb, b)
+static inline bool key_le(uint64_t pa, const char * a, uint64_t pb, const char * b) {
+	return pa < pb || (pa == pb && key_cmp<MAX_DNS_SIZE - 8>(a + 8, b + 8) <= 0);
+}
+
+static uint32_t page_checksum(const void * page) {
+	// Skips the header, which holds the checksum
+	return word_hash((const char*)page + 8, INDEX_PAGE_SIZE - 8);
+}
+
+DNS_DB::DnsIndex::NodeTree::NodeTree() : base(0), pages(0), header(0), npages(0), capacity(0), fd(-1), was_clean(true), lsn(0) {
+	static_assert(sizeof(Page) == INDEX_PAGE_SIZE, "Bad index page size");
+	clear();
+}
+
+DNS_DB::DnsIndex::NodeTree::~NodeTree() {
+	unmap();
+}
+
+void DNS_DB::DnsIndex::NodeTree::unmap() {
+	if (base)
+		munmap(base, (unsigned long)(capacity + 1) * INDEX_PAGE_SIZE);
+	if (fd >= 0)
+		close(fd);
+	base = 0;
+	pages = 0;
+	header = 0;
+	npages = capacity = 0;
+	fd = -1;
+	dirty.clear();
+}
+
+void DNS_DB::DnsIndex::NodeTree::clear() {
+	npages = 0;
+	dirty.clear();
+	root = NO_PAGE;
+	free_head = NO_PAGE;
+	total = 0;
+	if (header)
+		header->clean = 0;
+	updateHeader();
+}
+
+// Makes room for capacity pages, the mapping might move
+void DNS_DB::DnsIndex::NodeTree::grow(uint32_t capacity) {
+	unsigned long oldsize = (unsigned long)(this->capacity + 1) * INDEX_PAGE_SIZE;
+	unsigned long newsize = (unsigned long)(capacity + 1) * INDEX_PAGE_SIZE;
+
+	void * ptr;
+	if (fd >= 0) {
+		if (ftruncate(fd, newsize) < 0) {
+			perror("Could not grow the index file");
+			exit(1);
+		}
+	}
+	if (base)
+		ptr = mremap(base, oldsize, newsize, MREMAP_MAYMOVE);
+	else
+		ptr = mmap(0, newsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(ptr != MAP_FAILED);
+
+	base = (char*)ptr;
+	header = fd >= 0 ? (FileHeader*)base : 0;
+	pages = (Page*)(base + INDEX_PAGE_SIZE);
+	this->capacity = capacity;
+}
+
+uint32_t DNS_DB::DnsIndex::NodeTree::newPage(bool leaf) {
+	uint32_t pid = free_head;
+	if (pid != NO_PAGE)
+		free_head = pages[pid].inner.child[0];
+	else {
+		if (npages == capacity)
+			grow(capacity + capacity / 4 + 16);
+		pid = npages++;
+		dirty.resize(npages);
+	}
+	memset(&pages[pid], 0, INDEX_PAGE_SIZE);
+	pages[pid].leaf = leaf;
+	touch(pid);
+	return pid;
+}
+
+// Page pid is about to be modified. Concurrent writers (only updating the
+// node counters) might share pages, hence the atomic stores. The dirty
+// vector is only resized by open, sync and newPage (single writer or the
+// split lock held exclusively)
+void DNS_DB::DnsIndex::NodeTree::touch(uint32_t pid) {
+	assert(pid < dirty.size());
+	__atomic_store_n(&dirty[pid], 1, __ATOMIC_RELAXED);
+	if (header) {
+		__atomic_store_n(&header->clean, 0, __ATOMIC_RELAXED);
+		header->npages = npages;
+	}
+}
+
+void DNS_DB::DnsIndex::NodeTree::freePage(uint32_t pid) {
+	touch(pid);
+	memset(&pages[pid], 0, INDEX_PAGE_SIZE);
+	pages[pid].inner.child[0] = free_head;
+	free_head = pid;
+}
+
+// All the pages not in the tree are free
+void DNS_DB::DnsIndex::NodeTree::rebuildFreeList() {
+	std::vector <bool> used(npages);
+	if (root != NO_PAGE)
+		markPages(root, used);
+	free_head = NO_PAGE;
+	for (uint32_t pid = npages; pid-- > 0; )
+		if (!used[pid])
+			freePage(pid);
+}
+
+void DNS_DB::DnsIndex::NodeTree::markPages(uint32_t pid, std::vector <bool> & used) const {
+	used[pid] = true;
+	if (!pages[pid].leaf)
+		for (unsigned int i = 0; i < pages[pid].n; i++)
+			markPages(pages[pid].inner.child[i], used);
+}
+
+void DNS_DB::DnsIndex::NodeTree::updateHeader() {
+	if (header) {
+		header->root = root;
+		header->total = total;
+		header->npages = npages;
+		header->free_head = free_head;
+	}
+}
+
+unsigned int DNS_DB::DnsIndex::NodeTree::pageTotal(uint32_t pid) const {
+	const Page & p = pages[pid];
+	if (p.leaf)
+		return p.n;
+	unsigned int t = 0;
+	for (unsigned int i = 0; i < p.n; i++)
+		t += p.inner.count[i];
+	return t;
+}
+
+// Last child whose key is <= key (the first one if none)
+int DNS_DB::DnsIndex::NodeTree::childFor(const Page * p, uint64_t kp, const char * key) const {
+	int first = 1, last = p->n - 1, ret = 0;
+	while (first <= last) {
+		int middle = (first+last)>>1;
+		if (key_le(p->inner.prefix[middle], p->inner.key[middle], kp, key)) {
+			ret = middle;
+			first = middle + 1;
+		}
+		else
+			last = middle - 1;
+	}
+	return ret;
+}
+
+// Last leaf entry whose min is <= key (the first one if none)
+int DNS_DB::DnsIndex::NodeTree::entryFor(const Page * p, uint64_t kp, const char * key) const {
+	int first = 1, last = p->n - 1, ret = 0;
+	while (first <= last) {
+		int middle = (first+last)>>1;
+		if (key_le(p->entries.prefix[middle], p->entries.node[middle].min, kp, key)) {
+			ret = middle;
+			first = middle + 1;
+		}
+		else
+			last = middle - 1;
+	}
+	return ret;
+}
+
+// Rank of the last node whose min is <= key (0 if none)
+unsigned int DNS_DB::DnsIndex::NodeTree::find(const char * key) const {
+	assert(root != NO_PAGE);
+	uint64_t kp = key_prefix(key);
+	unsigned int rank = 0;
+	const Page * p = &pages[root];
+	while (!p->leaf) {
+		int c = childFor(p, kp, key);
+		for (int i = 0; i < c; i++)
+			rank += p->inner.count[i];
+		p = &pages[p->inner.child[c]];
+	}
+	return rank + entryFor(p, kp, key);
+}
+
+DNS_DB::DnsIndex::Node * DNS_DB::DnsIndex::NodeTree::lookupRank(unsigned int rank) const {
+	assert(rank < size());
+	const Page * p = &pages[root];
+	while (!p->leaf) {
+		int c = 0;
+		while (rank >= p->inner.count[c])
+			rank -= p->inner.count[c++];
+		p = &pages[p->inner.child[c]];
+	}
+	return const_cast<Node*>(&p->entries.node[rank]);
+}
+
+// Inserts the node and returns its rank
+unsigned int DNS_DB::DnsIndex::NodeTree::insert(const Node & node) {
+	if (root == NO_PAGE)
+		root = newPage(true);
+
+	unsigned int rank = 0;
+	uint32_t right = insertRec(root, node, &rank);
+	if (right != NO_PAGE) {
+		// The root was split, grow the tree
+		uint32_t left = root;
+		root = newPage(false);
+		Page & p = pages[root];
+		p.n = 2;
+		p.inner.child[0] = left;
+		p.inner.child[1] = right;
+		p.inner.count[0] = pageTotal(left);
+		p.inner.count[1] = pageTotal(right);
+		memcpy(p.inner.key[0], pages[left].firstKey(), MAX_DNS_SIZE);
+		memcpy(p.inner.key[1], pages[right].firstKey(), MAX_DNS_SIZE);
+		p.inner.prefix[0] = key_prefix(p.inner.key[0]);
+		p.inner.prefix[1] = key_prefix(p.inner.key[1]);
+	}
+	total++;
+	updateHeader();
+	return rank;
+}
+
+// Inserts the node under page pid, adding its rank (within the subtree) to
+// *rank. Returns the new right sibling if the page had to be split
+uint32_t DNS_DB::DnsIndex::NodeTree::insertRec(uint32_t pid, const Node & node, unsigned int * rank) {
+	uint64_t kp = key_prefix(node.min);
+
+	touch(pid);
+	if (pages[pid].leaf) {
+		Page * p = &pages[pid];
+		unsigned int pos = 0;
+		if (p->n > 0)
+			pos = entryFor(p, kp, node.min) + key_le(p->entries.prefix[0], p->entries.node[0].min, kp, node.min);
+		*rank += pos;
+
+		uint32_t right = NO_PAGE;
+		if (p->n == LEAF_MAX) {
+			unsigned int s = (pos == p->n) ? p->n : p->n / 2;
+			right = newPage(true);
+			p = &pages[pid];
+			Page * r = &pages[right];
+			r->n = p->n - s;
+			memcpy(r->entries.prefix, &p->entries.prefix[s], sizeof(uint64_t) * r->n);
+			memcpy(r->entries.node,   &p->entries.node[s],   sizeof(Node) * r->n);
+			p->n = s;
+			if (pos > s || s == LEAF_MAX) {
+				p = r;
+				pos -= s;
+			}
+		}
+		memmove(&p->entries.prefix[pos+1], &p->entries.prefix[pos], sizeof(uint64_t) * (p->n - pos));
+		memmove(&p->entries.node[pos+1],   &p->entries.node[pos],   sizeof(Node) * (p->n - pos));
+		p->entries.prefix[pos] = kp;
+		p->entries.node[pos] = node;
+		p->n++;
+		return right;
+	}
+
+	int c = childFor(&pages[pid], kp, node.min);
+	for (int i = 0; i < c; i++)
+		*rank += pages[pid].inner.count[i];
+	if (!key_le(pages[pid].inner.prefix[c], pages[pid].inner.key[c], kp, node.min)) {
+		memcpy(pages[pid].inner.key[c], node.min, MAX_DNS_SIZE);
+		pages[pid].inner.prefix[c] = kp;
+	}
+
+	uint32_t child = pages[pid].inner.child[c];
+	uint32_t split = insertRec(child, node, rank);
+
+	// The arena might have been reallocated
+	Page * p = &pages[pid];
+	p->inner.count[c]++;
+	if (split == NO_PAGE)
+		return NO_PAGE;
+
+	// Add the new child after c, splitting this page if needed
+	unsigned int pos = c + 1;
+	p->inner.count[c] = pageTotal(child);
+	unsigned int scount = pageTotal(split);
+
+	uint32_t right = NO_PAGE;
+	if (p->n == INNER_MAX) {
+		unsigned int s = (pos == p->n) ? p->n : p->n / 2;
+		right = newPage(false);
+		p = &pages[pid];
+		Page * r = &pages[right];
+		r->n = p->n - s;
+		memcpy(r->inner.prefix, &p->inner.prefix[s], sizeof(uint64_t) * r->n);
+		memcpy(r->inner.child,  &p->inner.child[s],  sizeof(uint32_t) * r->n);
+		memcpy(r->inner.count,  &p->inner.count[s],  sizeof(uint32_t) * r->n);
+		memcpy(r->inner.key,    &p->inner.key[s],    MAX_DNS_SIZE * r->n);
+		p->n = s;
+		if (pos > s || s == INNER_MAX) {
+			p = r;
+			pos -= s;
+		}
+	}
+	memmove(&p->inner.prefix[pos+1], &p->inner.prefix[pos], sizeof(uint64_t) * (p->n - pos));
+	memmove(&p->inner.child[pos+1],  &p->inner.child[pos],  sizeof(uint32_t) * (p->n - pos));
+	memmove(&p->inner.count[pos+1],  &p->inner.count[pos],  sizeof(uint32_t) * (p->n - pos));
+	memmove(&p->inner.key[pos+1],    &p->inner.key[pos],    MAX_DNS_SIZE * (p->n - pos));
+	p->inner.child[pos] = split;
+	p->inner.count[pos] = scount;
+	memcpy(p->inner.key[pos], pages[split].firstKey(), MAX_DNS_SIZE);
+	p->inner.prefix[pos] = key_prefix(p->inner.key[pos]);
+	p->n++;
+	return right;
+}
+
+// Changes the min of a node (keeping the order), fixing the keys of the
+// inner pages on the way if it is the first node of their subtrees
+void DNS_DB::DnsIndex::NodeTree::setMin(unsigned int rank, const char * vmin) {
+	assert(rank < size());
+	Page * p = &pages[root];
+	while (!p->leaf) {
+		int c = 0;
+		while (rank >= p->inner.count[c])
+			rank -= p->inner.count[c++];
+		if (rank == 0) {
+			touch(p - pages);
+			memcpy(p->inner.key[c], vmin, MAX_DNS_SIZE);
+			p->inner.prefix[c] = key_prefix(vmin);
+		}
+		p = &pages[p->inner.child[c]];
+	}
+	touch(p - pages);
+	memcpy(p->entries.node[rank].min, vmin, MAX_DNS_SIZE);
+	p->entries.prefix[rank] = key_prefix(vmin);
+}
+
+// Removes a node, its key range must have been given to the previous one.
+// Pages left empty are unlinked (and not reused) and, if the first node of
+// a subtree goes, the key of the subtree is raised to the new first one so
+// its old range is searched in the previous subtree
+void DNS_DB::DnsIndex::NodeTree::erase(unsigned int rank) {
+	assert(rank > 0 && rank < size());
+
+	// Inner pages on the way down and the child taken
+	std::vector < std::pair<uint32_t, int> > path;
+	uint32_t pid = root;
+	while (!pages[pid].leaf) {
+		Page * p = &pages[pid];
+		int c = 0;
+		while (rank >= p->inner.count[c])
+			rank -= p->inner.count[c++];
+		touch(pid);
+		p->inner.count[c]--;
+		path.push_back(std::make_pair(pid, c));
+		pid = p->inner.child[c];
+	}
+
+	touch(pid);
+	Page * p = &pages[pid];
+	p->n--;
+	memmove(&p->entries.prefix[rank], &p->entries.prefix[rank+1], sizeof(uint64_t) * (p->n - rank));
+	memmove(&p->entries.node[rank],   &p->entries.node[rank+1],   sizeof(Node) * (p->n - rank));
+
+	// Whether the first key of the page changed (or it is empty now)
+	bool first = (rank == 0);
+	while (first && !path.empty()) {
+		uint32_t child = pid;
+		int c = path.back().second;
+		pid = path.back().first;
+		path.pop_back();
+
+		p = &pages[pid];
+		if (pages[child].n == 0) {
+			freePage(child);
+			p->n--;
+			memmove(&p->inner.prefix[c], &p->inner.prefix[c+1], sizeof(uint64_t) * (p->n - c));
+			memmove(&p->inner.child[c],  &p->inner.child[c+1],  sizeof(uint32_t) * (p->n - c));
+			memmove(&p->inner.count[c],  &p->inner.count[c+1],  sizeof(uint32_t) * (p->n - c));
+			memmove(&p->inner.key[c],    &p->inner.key[c+1],    MAX_DNS_SIZE * (p->n - c));
+		}
+		else {
+			memcpy(p->inner.key[c], pages[child].firstKey(), MAX_DNS_SIZE);
+			p->inner.prefix[c] = key_prefix(p->inner.key[c]);
+		}
+		first = (c == 0);
+	}
+
+	// Node 0 stays, so the root cannot be empty
+	while (!pages[root].leaf && pages[root].n == 1) {
+		uint32_t old = root;
+		root = pages[root].inner.child[0];
+		freePage(old);
+	}
+	total--;
+	updateHeader();
+}
+
+void DNS_DB::DnsIndex::NodeTree::setCounts(unsigned int rank, unsigned int used, unsigned int domains, unsigned int ips) {
+	Node * n = lookupRank(rank);
+	touch(((char*)n - (char*)pages) / INDEX_PAGE_SIZE);
+	n->used = used;
+	n->domains = domains;
+	n->ips = ips;
+}
+
+// Calls cb for every node, in order
+void DNS_DB::DnsIndex::NodeTree::scan(const std::function<void(const Node & n)> & cb) const {
+	if (root != NO_PAGE)
+		scanPage(root, cb);
+}
+
+void DNS_DB::DnsIndex::NodeTree::scanPage(uint32_t pid, const std::function<void(const Node & n)> & cb) const {
+	const Page * p = &pages[pid];
+	for (unsigned int i = 0; i < p->n; i++) {
+		if (p->leaf)
+			cb(p->entries.node[i]);
+		else
+			scanPage(p->inner.child[i], cb);
+	}
+}
+
+// The max is not a key, it can be changed in place
+void DNS_DB::DnsIndex::NodeTree::setMax(unsigned int rank, const char * vmax) {
+	Node * n = lookupRank(rank);
+	touch(((char*)n - (char*)pages) / INDEX_PAGE_SIZE);
+	memcpy(n->max, vmax, MAX_DNS_SIZE);
+}
+
+// Builds the tree bottom up from nodes sorted by min, with full pages
+void DNS_DB::DnsIndex::NodeTree::build(const std::vector <Node> & sorted) {
+	clear();
+	if (sorted.empty())
+		return;
+
+	std::vector <uint32_t> level;
+	for (unsigned int i = 0; i < sorted.size(); i += LEAF_MAX) {
+		uint32_t pid = newPage(true);
+		Page & p = pages[pid];
+		p.n = std::min((unsigned long)LEAF_MAX, sorted.size() - i);
+		memcpy(p.entries.node, &sorted[i], sizeof(Node) * p.n);
+		for (unsigned int j = 0; j < p.n; j++)
+			p.entries.prefix[j] = key_prefix(p.entries.node[j].min);
+		level.push_back(pid);
+	}
+
+	while (level.size() > 1) {
+		std::vector <uint32_t> up;
+		for (unsigned int i = 0; i < level.size(); i += INNER_MAX) {
+			uint32_t pid = newPage(false);
+			Page & p = pages[pid];
+			p.n = std::min((unsigned long)INNER_MAX, level.size() - i);
+			for (unsigned int j = 0; j < p.n; j++) {
+				p.inner.child[j] = level[i+j];
+				p.inner.count[j] = pageTotal(level[i+j]);
+				memcpy(p.inner.key[j], pages[level[i+j]].firstKey(), MAX_DNS_SIZE);
+				p.inner.prefix[j] = key_prefix(p.inner.key[j]);
+			}
+			up.push_back(pid);
+		}
+		level.swap(up);
+	}
+	root = level[0];
+	total = sorted.size();
+	updateHeader();
+}
+
+bool DNS_DB::DnsIndex::NodeTree::open(const std::string & file, uint32_t * next_id) {
+	int f = ::open(file.c_str(), O_RDWR);
+	if (f < 0)
+		return false;
+
+	FileHeader h;
+	off_t size = lseek(f, 0, SEEK_END);
+	if (pread(f, &h, sizeof(h), 0) != sizeof(h) || h.magic != INDEX_MAGIC || h.version < 2) {
+		close(f);
+		return false;
+	}
+
+	// The header checksum is only updated by sync
+	bool old = (h.version < INDEX_VERSION);
+	unsigned long hsize = h.version == 2 ? V2_HEADER_SIZE : h.version == 3 ? V3_HEADER_SIZE : sizeof(h);
+	uint64_t sum = h.checksum;
+	h.checksum = 0;
+	if (h.version == 2)
+		h.free_head = NO_PAGE;
+	if (old)
+		h.lsn = 0;
+	if (h.version > INDEX_VERSION || h.page_size != INDEX_PAGE_SIZE ||
+		(h.clean && sum != word_hash(&h, hsize)) ||
+		size % INDEX_PAGE_SIZE != 0 || h.npages > size / INDEX_PAGE_SIZE - 1 ||
+		(h.root != NO_PAGE && h.root >= h.npages) || (h.free_head != NO_PAGE && h.free_head >= h.npages)) {
+
+		fprintf(stderr, "Bad index file %s (version %u)!\n", file.c_str(), h.version);
+		exit(1);
+	}
+
+	unmap();
+	fd = f;
+	capacity = size / INDEX_PAGE_SIZE - 1;
+	base = (char*)mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(base != MAP_FAILED);
+	header = (FileHeader*)base;
+	pages = (Page*)(base + INDEX_PAGE_SIZE);
+	npages = h.npages;
+	root = h.root;
+	total = h.total;
+	free_head = h.free_head;
+	was_clean = h.clean;
+	lsn = h.lsn;
+	*next_id = h.next_id;
+
+	// Checking all the pages is not cheap, only done if they might be broken
+	bool check = !h.clean;
+	#ifdef EXTRA_CHECK
+	check = true;
+	#endif
+	if (!h.clean)
+		fprintf(stderr, "Warning: index %s was not closed cleanly, checking it\n", file.c_str());
+	if (check && !verify()) {
+		fprintf(stderr, "Index file %s is damaged!\n", file.c_str());
+		exit(1);
+	}
+	dirty.assign(npages, !h.clean);
+
+	// The free list might be broken too (version 2 leaked the erased pages)
+	if (!h.clean || h.version == 2)
+		rebuildFreeList();
+	if (old) {
+		header->version = INDEX_VERSION;
+		header->lsn = 0;
+		updateHeader();
+		if (header->clean) {
+			header->checksum = 0;
+			header->checksum = word_hash(header, sizeof(FileHeader));
+		}
+	}
+	if (!h.clean) {
+		// Recompute all the checksums on the next sync, the next block ID
+		// in the header is stale too
+		*next_id = 0;
+		for (unsigned int i = 0; i < total; i++)
+			*next_id = std::max(*next_id, (*this)[i].dnsblock_id + 1);
+	}
+	return true;
+}
+
+bool DNS_DB::DnsIndex::NodeTree::readOld(const std::string & file, std::vector <Node> & sorted) {
+	FILE * f = fopen(file.c_str(), "rb");
+	if (f == NULL)
+		return false;
+
+	FileHeader h;
+	if (fread(&h, 1, sizeof(h), f) != sizeof(h) || h.magic != INDEX_MAGIC || h.version != 1) {
+		fclose(f);
+		return false;
+	}
+
+	// All the pages are in use, the nodes are in the leaves
+	std::vector <char> page(INDEX_PAGE_SIZE);
+	sorted.clear();
+	for (uint32_t pid = 0; pid < h.npages; pid++) {
+		if (fseek(f, (long)(pid + 1) * INDEX_PAGE_SIZE, SEEK_SET) < 0 ||
+			fread(&page[0], 1, INDEX_PAGE_SIZE, f) != INDEX_PAGE_SIZE) {
+			fprintf(stderr, "Could not read index %s!\n", file.c_str());
+			exit(1);
+		}
+		uint16_t n, leaf;
+		memcpy(&n, &page[0], 2);
+		memcpy(&leaf, &page[2], 2);
+		if (!leaf)
+			continue;
+		assert(n <= V1_LEAF_MAX);
+		for (unsigned int i = 0; i < n; i++) {
+			Node node;
+			memset(&node, 0, sizeof(node));
+			memcpy(&node, &page[8 + 8*V1_LEAF_MAX + i*V1_NODE_SIZE], V1_NODE_SIZE);
+			sorted.push_back(node);
+		}
+	}
+	fclose(f);
+	std::sort(sorted.begin(), sorted.end(), Node::lessthan);
+	return true;
+}
+
+bool DNS_DB::DnsIndex::NodeTree::write(const std::string & file, uint32_t next_id, uint64_t lsn) const {
+	std::string tmp = file + ".tmp";
+	FILE * f = fopen(tmp.c_str(), "wb");
+	if (f == NULL)
+		return false;
+
+	std::vector <char> page(INDEX_PAGE_SIZE);
+	FileHeader * h = (FileHeader*)&page[0];
+	h->magic = INDEX_MAGIC;
+	h->version = INDEX_VERSION;
+	h->page_size = INDEX_PAGE_SIZE;
+	h->clean = 1;
+	h->root = root;
+	h->total = total;
+	h->npages = npages;
+	h->next_id = next_id;
+	h->free_head = free_head;
+	h->lsn = lsn;
+	h->checksum = word_hash(h, sizeof(FileHeader));
+	bool ok = fwrite(&page[0], 1, INDEX_PAGE_SIZE, f) == INDEX_PAGE_SIZE;
+
+	for (uint32_t i = 0; i < npages && ok; i++) {
+		memcpy(&page[0], &pages[i], INDEX_PAGE_SIZE);
+		((Page*)&page[0])->check = page_checksum(&page[0]);
+		ok = fwrite(&page[0], 1, INDEX_PAGE_SIZE, f) == INDEX_PAGE_SIZE;
+	}
+	ok = (fflush(f) == 0) && ok && fsync(fileno(f)) == 0;
+	fclose(f);
+	if (!ok || rename(tmp.c_str(), file.c_str()) < 0) {
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	// And the rename
+	std::string dir = file.substr(0, file.rfind('/') + 1) + ".";
+	int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	ok = dfd >= 0 && fsync(dfd) == 0;
+	if (dfd >= 0)
+		close(dfd);
+	return ok;
+}
+
+bool DNS_DB::DnsIndex::NodeTree::save(const std::string & file, uint32_t next_id) {
+	uint32_t id;
+	return write(file, next_id, 0) && open(file, &id);
+}
+
+// Only the pages modified since the last sync are written back
+void DNS_DB::DnsIndex::NodeTree::sync(uint32_t next_id) {
+	if (!header)
+		return;
+
+	for (uint32_t i = 0; i < dirty.size() && i < npages; i++)
+		if (dirty[i])
+			pages[i].check = page_checksum(&pages[i]);
+	dirty.assign(npages, 0);
+
+	header->root = root;
+	header->total = total;
+	header->npages = npages;
+	header->free_head = free_head;
+	header->next_id = next_id;
+	header->clean = 1;
+	header->checksum = 0;
+	header->checksum = word_hash(header, sizeof(FileHeader));
+	msync(base, (unsigned long)(capacity + 1) * INDEX_PAGE_SIZE, MS_SYNC);
+}
+
+// Checks the pages under pid: counts, key order (all keys in [lo, hi)) and
+// checksums (if there were no changes since the last sync). Returns the
+// number of nodes
+unsigned int DNS_DB::DnsIndex::NodeTree::checkPage(uint32_t pid, const char * lo, const char * hi, bool * ok) const {
+	if (pid >= npages) {
+		*ok = false;
+		return 0;
+	}
+	const Page * p = &pages[pid];
+	if (p->n == 0 || p->n > (p->leaf ? LEAF_MAX : INNER_MAX)) {
+		*ok = false;
+		return 0;
+	}
+	// Checksums are stale once the tree is modified
+	if (header && header->clean && p->check != page_checksum(p))
+		*ok = false;
+
+	if (p->leaf) {
+		for (unsigned int i = 0; i < p->n; i++) {
+			const Node & n = p->entries.node[i];
+			if (p->entries.prefix[i] != key_prefix(n.min) || less(n.min, lo) || !less(n.min, hi) || !less(n.min, n.max) ||
+				(i > 0 && !eq(p->entries.node[i-1].max, n.min)))
+				*ok = false;
+		}
+		return p->n;
+	}
+
+	unsigned int t = 0;
+	for (unsigned int i = 0; i < p->n && *ok; i++) {
+		const char * next = i+1 < p->n ? p->inner.key[i+1] : hi;
+		if (p->inner.prefix[i] != key_prefix(p->inner.key[i]) || less(p->inner.key[i], lo) || !less(p->inner.key[i], next))
+			*ok = false;
+		unsigned int c = checkPage(p->inner.child[i], p->inner.key[i], next, ok);
+		if (c != p->inner.count[i])
+			*ok = false;
+		t += c;
+	}
+	return t;
+}
+
+bool DNS_DB::DnsIndex::NodeTree::verify() const {
+	if (root == NO_PAGE)
+		return true;
+	bool ok = true;
+	char hi[MAX_DNS_SIZE + 1];
+	memset(hi, ~0, sizeof(hi));
+	unsigned int t = checkPage(root, DOMAIN_MIN, hi, &ok);
+	return ok && t == total;
+}
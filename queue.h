@@ -0,0 +1,56 @@
+
+#ifndef QUEUE__H__
+#define QUEUE__H__
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Bounded blocking FIFO queue to connect pipeline stages. Producers block
+// when the queue is full, consumers when it is empty. Once closed, push
+// fails and pop drains the remaining elements before failing.
+template <typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(unsigned int maxsize) : maxsize(maxsize), closed(false) {}
+
+	bool push(T && v) {
+		std::unique_lock<std::mutex> lock(m);
+		while (q.size() >= maxsize && !closed)
+			notfull.wait(lock);
+		if (closed)
+			return false;
+		q.push_back(std::move(v));
+		notempty.notify_one();
+		return true;
+	}
+
+	bool pop(T & v) {
+		std::unique_lock<std::mutex> lock(m);
+		while (q.empty() && !closed)
+			notempty.wait(lock);
+		if (q.empty())
+			return false;
+		v = std::move(q.front());
+		q.pop_front();
+		notfull.notify_one();
+		return true;
+	}
+
+	void close() {
+		std::unique_lock<std::mutex> lock(m);
+		closed = true;
+		notfull.notify_all();
+		notempty.notify_all();
+	}
+
+private:
+	std::mutex m;
+	std::condition_variable notfull, notempty;
+	std::deque <T> q;
+	unsigned int maxsize;
+	bool closed;
+};
+
+#endif
+
@@ -11,7 +11,7 @@ struct IPv4_Record {
 	Timestamp first_seen, last_seen;
 	IPv4 ip;
 };
-static bool operator==(const IPv4_Record& lhs, const IPv4_Record& rhs) {
+inline bool operator==(const IPv4_Record& lhs, const IPv4_Record& rhs) {
     return lhs.ip == rhs.ip && lhs.first_seen == rhs.first_seen && lhs.last_seen == rhs.last_seen;
 }
 
@@ -0,0 +1,46 @@
+
+#ifndef RWLOCK__H__
+#define RWLOCK__H__
+
+#include <pthread.h>
+
+// Reader/writer lock (writer preferring, so a stream of readers does not
+// starve the writers) and scoped guards for it
+class RWLock {
+public:
+	RWLock() {
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+	}
+	~RWLock() { pthread_rwlock_destroy(&lock); }
+
+	void rdlock() { pthread_rwlock_rdlock(&lock); }
+	void wrlock() { pthread_rwlock_wrlock(&lock); }
+	void unlock() { pthread_rwlock_unlock(&lock); }
+
+private:
+	RWLock(const RWLock &);
+	pthread_rwlock_t lock;
+};
+
+class ReadGuard {
+public:
+	ReadGuard(RWLock & l) : l(l) { l.rdlock(); }
+	~ReadGuard() { l.unlock(); }
+private:
+	RWLock & l;
+};
+
+class WriteGuard {
+public:
+	WriteGuard(RWLock & l) : l(l) { l.wrlock(); }
+	~WriteGuard() { l.unlock(); }
+private:
+	RWLock & l;
+};
+
+#endif
+
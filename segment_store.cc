@@ -0,0 +1,203 @@
+
+#include <string>
+#include <string.h>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <assert.h>
+#include "dns_db.h"
+
+/** Segment storage */
+
+// Extent e lives in segment e / SEGMENT_BLOCKS at offset (e % SEGMENT_BLOCKS)
+// blocks. The block trailers are stored after all the blocks of the
+// segment, in the same order, and the slot directories (SLOT_DIRECTORY
+// builds only) after the trailers. Segments are created (preallocated) and
+// mapped on first use.
+// Table file format: 4 byte magic and size, then the table.
+
+#define NO_EXTENT      (~0U)
+#define EXTENTS_MAGIC  0x54474553   // "SEGT"
+
+DNS_DB::SegmentStore::~SegmentStore() {
+	for (unsigned int i = 0; i < segments.size(); i++)
+		if (segments[i])
+			FileMapper::getInstance().unmap(segments[i]);
+}
+
+void DNS_DB::SegmentStore::enable(const std::string & path) {
+	this->path = path;
+	this->enabled = true;
+	this->next_extent = 0;
+	mkdir(path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+}
+
+// Loads the block -> extent table, the extents not
+// referenced below the highest one in use are free
+void DNS_DB::SegmentStore::setTable(const std::string & path, const std::vector <uint32_t> & table) {
+	enable(path);
+	extents = table;
+
+	std::vector <bool> used;
+	for (unsigned int i = 0; i < extents.size(); i++) {
+		if (extents[i] == NO_EXTENT)
+			continue;
+		if (extents[i] >= next_extent)
+			next_extent = extents[i] + 1;
+		if (extents[i] >= used.size())
+			used.resize(extents[i] + 1);
+		used[extents[i]] = true;
+	}
+
+	free_extents.clear();
+	for (uint32_t e = 0; e < next_extent; e++)
+		if (!used[e])
+			free_extents.push_back(e);
+}
+
+void DNS_DB::SegmentStore::load(const std::string & path) {
+	FILE * fd = fopen((path + "/extents").c_str(), "rb");
+	if (fd == NULL)
+		return;
+
+	uint32_t hdr[2];
+	std::vector <uint32_t> table;
+	bool ok = fread(hdr, 1, sizeof(hdr), fd) == sizeof(hdr) && hdr[0] == EXTENTS_MAGIC;
+	if (ok) {
+		table.resize(hdr[1]);
+		ok = table.empty() || fread(&table[0], sizeof(uint32_t), table.size(), fd) == table.size();
+	}
+	fclose(fd);
+
+	if (!ok) {
+		fprintf(stderr, "Could not read the segment table in %s!\n", path.c_str());
+		exit(1);
+	}
+	setTable(path, table);
+}
+
+void DNS_DB::SegmentStore::save() {
+	if (!enabled)
+		return;
+
+	// Replaced as a whole, checkpoints need either the old or the new one
+	std::string file = path + "/extents", tmp = file + ".tmp";
+	FILE * fd = fopen(tmp.c_str(), "wb");
+	if (fd == NULL) {
+		fprintf(stderr, "Could not write the segment table in %s!\n", path.c_str());
+		return;
+	}
+	uint32_t hdr[2] = { EXTENTS_MAGIC, (uint32_t)extents.size() };
+	bool ok = fwrite(hdr, 1, sizeof(hdr), fd) == sizeof(hdr);
+	if (!extents.empty())
+		ok = fwrite(&extents[0], sizeof(uint32_t), extents.size(), fd) == extents.size() && ok;
+	ok = fflush(fd) == 0 && ok && fsync(fileno(fd)) == 0;
+	fclose(fd);
+	if (!ok || rename(tmp.c_str(), file.c_str()) < 0) {
+		fprintf(stderr, "Could not write the segment table in %s!\n", path.c_str());
+		unlink(tmp.c_str());
+	}
+}
+
+// Frees the blocks which are not in use (left behind by a crash), returns
+// how many
+unsigned int DNS_DB::SegmentStore::collect(const std::vector <bool> & inuse) {
+	unsigned int freed = 0;
+	for (unsigned int i = 0; i < extents.size(); i++) {
+		if (extents[i] != NO_EXTENT && (i >= inuse.size() || !inuse[i])) {
+			freeBlock(i);
+			freed++;
+		}
+	}
+	return freed;
+}
+
+std::string DNS_DB::SegmentStore::getFile(unsigned int seg) const {
+	char file[32];
+	snprintf(file, sizeof(file), "/seg-%04u.dat", seg);
+	return path + file;
+}
+
+// Returns the segment file of a block, and the offsets in it of the
+// block, its trailer and its slot directory
+std::string DNS_DB::SegmentStore::locate(unsigned int blkid, unsigned long * offsets) const {
+	assert(blkid < extents.size() && extents[blkid] != NO_EXTENT);
+	uint32_t e = extents[blkid], k = e % SEGMENT_BLOCKS;
+	offsets[0] = (unsigned long)k * DnsBlock::blockSize;
+	offsets[1] = (unsigned long)SEGMENT_BLOCKS * DnsBlock::blockSize + k * DnsBlock::trailerSize;
+	offsets[2] = (unsigned long)SEGMENT_BLOCKS * (DnsBlock::blockSize + DnsBlock::trailerSize) + k * DnsBlock::directorySize;
+	return getFile(e / SEGMENT_BLOCKS);
+}
+
+void * DNS_DB::SegmentStore::getExtent(uint32_t e) {
+	unsigned int seg = e / SEGMENT_BLOCKS;
+	if (seg >= segments.size())
+		segments.resize(seg + 1, 0);
+
+	if (!segments[seg]) {
+		std::string segfile = getFile(seg);
+		// Old segments lack the trailers
+		unsigned int size = SEGMENT_BLOCKS * (DnsBlock::blockSize + DnsBlock::trailerSize);
+		#ifdef SLOT_DIRECTORY
+		size += SEGMENT_BLOCKS * DnsBlock::directorySize;
+		#endif
+		if (!FileMapper::getInstance().fileExists(segfile))
+			FileMapper::getInstance().createFile(segfile, size);
+		else
+			FileMapper::getInstance().extendFile(segfile, size);
+		segments[seg] = FileMapper::getInstance().mapFile(segfile);
+	}
+	return (char*)segments[seg] + (unsigned long)(e % SEGMENT_BLOCKS) * DnsBlock::blockSize;
+}
+
+void * DNS_DB::SegmentStore::getTrailer(uint32_t e) {
+	char * seg = (char*)getExtent(e - e % SEGMENT_BLOCKS);
+	return seg + (unsigned long)SEGMENT_BLOCKS * DnsBlock::blockSize + (e % SEGMENT_BLOCKS) * DnsBlock::trailerSize;
+}
+
+void * DNS_DB::SegmentStore::getDirectory(uint32_t e) {
+	#ifdef SLOT_DIRECTORY
+	char * seg = (char*)getExtent(e - e % SEGMENT_BLOCKS);
+	return seg + (unsigned long)SEGMENT_BLOCKS * (DnsBlock::blockSize + DnsBlock::trailerSize) +
+		(e % SEGMENT_BLOCKS) * DnsBlock::directorySize;
+	#else
+	(void)e;
+	return 0;
+	#endif
+}
+
+// Returns the block, its trailer and its slot directory (if the build has them)
+void * DNS_DB::SegmentStore::getBlock(unsigned int blkid, void ** trailer, void ** directory) {
+	if (blkid >= extents.size())
+		extents.resize(blkid + 1, NO_EXTENT);
+
+	if (extents[blkid] != NO_EXTENT) {
+		*trailer = getTrailer(extents[blkid]);
+		*directory = getDirectory(extents[blkid]);
+		return getExtent(extents[blkid]);
+	}
+
+	// New block, reuse a free extent or take a new one. Either might be
+	// dirty (new ones too if they were used before a crash)
+	if (!free_extents.empty()) {
+		extents[blkid] = free_extents.back();
+		free_extents.pop_back();
+	}
+	else
+		extents[blkid] = next_extent++;
+	void * ptr = getExtent(extents[blkid]);
+	*trailer = getTrailer(extents[blkid]);
+	*directory = getDirectory(extents[blkid]);
+	memset(ptr, 0, DnsBlock::blockSize);
+	memset(*trailer, 0, DnsBlock::trailerSize);
+	return ptr;
+}
+
+void DNS_DB::SegmentStore::freeBlock(unsigned int blkid) {
+	assert(blkid < extents.size() && extents[blkid] != NO_EXTENT);
+	free_extents.push_back(extents[blkid]);
+	extents[blkid] = NO_EXTENT;
+}
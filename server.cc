@@ -3,12 +3,360 @@
  * Server implementation for Dns DB
  *
  * The implementation has objects:
- * 
+ *
  *  - Cursor: To iterate over objects
  *  - Database: Access object to add/remove records
  *  - Domain: Basic record stored in the DB
  *  - Command: a query/request to the DB
  *  - Transaction: a group of commands
  *
+ * One long lived process keeps the DB (and its block cache) open and
+ * serves the Command wire protocol (see command.h) over TCP. It runs a
+ * single threaded event loop on epoll with non-blocking sockets. Clients
+ * can pipeline requests: every complete frame in the input buffer is
+ * executed in order and the replies are batched in the output buffer.
+ * Cursors are DomainIterators owned by the connection, released with
+ * CloseIterator or on disconnect.
+ *
 **/
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "dns_db.h"
+#include "command.h"
+
+bool doexit = false;
+
+void sigterm(int) {
+	doexit = true;
+}
+
+class Connection {
+public:
+	Connection(int fd) : fd(fd), out_off(0), events(0), next_cursor(1) {}
+	~Connection() { close(fd); }
+
+	int fd;
+	std::string in, out;
+	unsigned long out_off;    // Already written
+	uint32_t events;          // Registered in epoll
+
+	std::map < unsigned int, std::unique_ptr <DNS_DB::DomainIterator> > cursors;
+	unsigned int next_cursor;
+};
+
+class Server {
+public:
+	Server(DNS_DB & db, int port);
+	~Server();
+	void run();
+
+private:
+	void acceptAll();
+	void closeConn(Connection * c);
+	bool readable(Connection * c);
+	bool writable(Connection * c);
+	bool process(Connection * c);
+	void updateEvents(Connection * c);
+	void execute(Connection * c, const Command & cmd, Reply & r);
+
+	DNS_DB & db;
+	int lfd, epfd;
+	std::unordered_map <int, Connection*> conns;
+	unsigned long requests, connections;
+};
+
+static bool set_nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+Server::Server(DNS_DB & db, int port) : db(db), requests(0), connections(0) {
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, SERVER_BACKLOG) < 0) {
+		fprintf(stderr, "Could not listen on port %d: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	set_nonblock(lfd);
+
+	epfd = epoll_create1(0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = lfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+}
+
+Server::~Server() {
+	for (std::unordered_map <int, Connection*>::iterator it = conns.begin(); it != conns.end(); ++it)
+		delete it->second;
+	close(epfd);
+	close(lfd);
+}
+
+void Server::run() {
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	time_t last = time(0);
+	unsigned long last_requests = 0;
+
+	while (!doexit) {
+		int n = epoll_wait(epfd, events, SERVER_MAX_EVENTS, 1000);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == lfd) {
+				acceptAll();
+				continue;
+			}
+
+			std::unordered_map <int, Connection*>::iterator it = conns.find(events[i].data.fd);
+			if (it == conns.end())
+				continue;
+			Connection * c = it->second;
+
+			bool ok = !(events[i].events & EPOLLERR);
+			if (ok && (events[i].events & (EPOLLIN | EPOLLHUP)))
+				ok = readable(c);
+			if (ok && (events[i].events & EPOLLOUT))
+				ok = writable(c);
+			if (!ok)
+				closeConn(c);
+		}
+
+		time_t now = time(0);
+		if (now - last >= SERVER_STATS_INTERVAL) {
+			if (requests != last_requests)
+				fprintf(stderr, "%lu connections, %.0f requests/s\n", (unsigned long)conns.size(),
+					(requests - last_requests) / double(now - last));
+			last = now;
+			last_requests = requests;
+		}
+	}
+	fprintf(stderr, "Served %lu requests on %lu connections\n", requests, connections);
+}
+
+void Server::acceptAll() {
+	while (true) {
+		int fd = accept(lfd, 0, 0);
+		if (fd < 0)
+			return;
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		set_nonblock(fd);
+
+		Connection * c = new Connection(fd);
+		conns[fd] = c;
+		connections++;
+
+		struct epoll_event ev;
+		ev.events = c->events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+void Server::closeConn(Connection * c) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, 0);
+	conns.erase(c->fd);
+	delete c;
+}
+
+// One read per wakeup, so busy connections do not starve the others
+bool Server::readable(Connection * c) {
+	char buf[SERVER_READ_SIZE];
+	ssize_t r = read(c->fd, buf, sizeof(buf));
+	if (r == 0)
+		return false;
+	if (r < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	c->in.append(buf, r);
+	return process(c);
+}
+
+bool Server::writable(Connection * c) {
+	while (c->out_off < c->out.size()) {
+		ssize_t w = write(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off);
+		if (w < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			return false;
+		}
+		c->out_off += w;
+	}
+	if (c->out_off == c->out.size()) {
+		c->out.clear();
+		c->out_off = 0;
+
+		// There might be requests waiting for the output to drain
+		if (!c->in.empty())
+			return process(c);
+	}
+	updateEvents(c);
+	return true;
+}
+
+// Runs all the complete requests in the input buffer (while the output is
+// not too far behind) and tries to send the replies right away
+bool Server::process(Connection * c) {
+	unsigned long off = 0;
+	while (c->out.size() - c->out_off < SERVER_MAX_OUTPUT) {
+		Command cmd;
+		int n = Command::decode(c->in.data() + off, c->in.size() - off, cmd);
+		if (n < 0)
+			return false;    // Protocol error, drop the client
+		if (n == 0)
+			break;
+		off += n;
+
+		Reply r(Reply::OK, cmd.getIteratorId());
+		execute(c, cmd, r);
+		r.encode(c->out);
+		requests++;
+	}
+	c->in.erase(0, off);
+
+	if (c->out_off < c->out.size())
+		return writable(c);
+	updateEvents(c);
+	return true;
+}
+
+// Stop reading while the output is backed up
+void Server::updateEvents(Connection * c) {
+	unsigned long pending = c->out.size() - c->out_off;
+	uint32_t want = (pending ? (uint32_t)EPOLLOUT : 0) | (pending < SERVER_MAX_OUTPUT ? (uint32_t)EPOLLIN : 0);
+	if (want == c->events)
+		return;
+
+	struct epoll_event ev;
+	ev.events = c->events = want;
+	ev.data.fd = c->fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void Server::execute(Connection * c, const Command & cmd, Reply & r) {
+	std::map < unsigned int, std::unique_ptr <DNS_DB::DomainIterator> >::iterator cur;
+	switch (cmd.getType()) {
+	case Command::QueryDomain:
+		r.status = db.hasDomain(cmd.getDomain()) ? Reply::OK : Reply::NotFound;
+		break;
+
+	case Command::GetIterator:
+		if (c->cursors.size() >= SERVER_MAX_CURSORS) {
+			r.status = Reply::Error;
+			break;
+		}
+		// Iterators can only start at an existing domain
+		if (cmd.getDomain().empty() ? db.isEmpty() : !db.hasDomain(cmd.getDomain())) {
+			r.status = Reply::NotFound;
+			break;
+		}
+		r.iterator = c->next_cursor++;
+		c->cursors[r.iterator].reset(new DNS_DB::DomainIterator(
+			cmd.getDomain().empty() ? db.getDomainIterator() : db.getDomainIterator(cmd.getDomain())));
+		break;
+
+	case Command::IteratorNext:
+	case Command::IteratorValue:
+	case Command::CloseIterator:
+		cur = c->cursors.find(cmd.getIteratorId());
+		if (cur == c->cursors.end()) {
+			r.status = Reply::BadRequest;
+			break;
+		}
+		if (cmd.getType() == Command::CloseIterator)
+			c->cursors.erase(cur);
+		else if (cmd.getType() == Command::IteratorValue) {
+			r.domain = cur->second->getDomain();
+			r.records = cur->second->getIpsv4();
+		}
+		else if (cur->second->end())
+			r.status = Reply::End;
+		else
+			cur->second->next();
+		break;
+
+	case Command::AddDomain:
+		switch (db.addDomain(cmd.getDomain())) {
+		case DNS_DB::resOK:            r.status = Reply::OK;            break;
+		case DNS_DB::resAlreadyExists: r.status = Reply::AlreadyExists; break;
+		case DNS_DB::resDomainTooLong: r.status = Reply::BadRequest;    break;
+		default:                       r.status = Reply::Error;         break;
+		}
+		break;
+
+	case Command::UpdateDomain:
+		// Adds the records to an existing domain (not a part of them)
+		if (cmd.isTruncated()) {
+			r.status = Reply::BadRequest;
+			break;
+		}
+		if (!db.hasDomain(cmd.getDomain())) {
+			r.status = Reply::NotFound;
+			break;
+		}
+		for (unsigned int i = 0; i < cmd.getRecords().size(); i++)
+			db.addIp4Record(cmd.getDomain(), cmd.getRecords()[i]);
+		break;
+
+	case Command::DeleteDomain:
+		switch (db.deleteDomain(cmd.getDomain())) {
+		case DNS_DB::resOK:            r.status = Reply::OK;            break;
+		case DNS_DB::resNotFound:      r.status = Reply::NotFound;      break;
+		case DNS_DB::resDomainTooLong: r.status = Reply::BadRequest;    break;
+		default:                       r.status = Reply::Error;         break;
+		}
+		break;
+
+	// Not supported by the DB (yet)
+	case Command::IteratorPrev:
+		r.status = Reply::Unsupported;
+		break;
+	}
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s dbpath [port]\n", argv[0]);
+		exit(0);
+	}
+
+	signal(SIGTERM, sigterm);
+	signal(SIGINT,  sigterm);
+	signal(SIGPIPE, SIG_IGN);
+
+	std::string pathdb = std::string(argv[1]);
+	int port = argc > 2 ? atoi(argv[2]) : SERVER_PORT;
+
+	DNS_DB db(pathdb);
+	Server server(db, port);
+	fprintf(stderr, "Listening on port %d\n", port);
+	server.run();
+	return 0;
+}
+
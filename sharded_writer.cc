@@ -0,0 +1,162 @@
+
+#include <string>
+#include <string.h>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dns_db.h"
+
+/** Sharded writer */
+
+// Keys are routed to the writer owning their range and queued in batches.
+// Shard ranges start at node minimums, which never change (splits only
+// add new boundaries inside a node), so a range always maps to the same
+// set of blocks. Each time the index doubles its size the batches in flight
+// are drained and the ranges recomputed, so new DBs (a single node at
+// first) end up spread over all the writers.
+
+DNS_DB::ShardedWriter::ShardedWriter(DNS_DB * dbref, int nshards) : db(dbref), nactive(0), split_mark(0), nodes_mark(0),
+	inflight(0), num_added(0), num_dups(0), num_partitions(0), finished(false) {
+
+	if (nshards < 1) nshards = 1;
+
+	// Keep the readers out until we are done
+	db->dblock.wrlock();
+	db->startLog();
+
+	for (int i = 0; i < nshards; i++) {
+		shards.push_back(std::unique_ptr<Shard>(new Shard()));
+		shards[i]->pending.reserve(WRITER_BATCH * MAX_DNS_SIZE);
+	}
+	partition();
+
+	for (int i = 0; i < nshards; i++)
+		shards[i]->thread = std::thread(&DNS_DB::ShardedWriter::writer, this, shards[i].get());
+}
+
+DNS_DB::ShardedWriter::~ShardedWriter() {
+	finish();
+}
+
+DNS_DB::queryError DNS_DB::ShardedWriter::addDomain(const std::string & domain) {
+	char domint[MAX_DNS_SIZE];
+	if (!domain2idom(domain.c_str(), domint))
+		return resDomainTooLong;
+	return addIDomain(domint);
+}
+
+// The domain is only queued, duplicates are found (and counted) later
+DNS_DB::queryError DNS_DB::ShardedWriter::addIDomain(const char * domint) {
+	assert(!finished);
+	Shard * s = shards[route(domint)].get();
+	s->pending.insert(s->pending.end(), domint, domint + MAX_DNS_SIZE);
+	if (s->pending.size() < (unsigned long)WRITER_BATCH * MAX_DNS_SIZE)
+		return resOK;
+
+	dispatch(s);
+
+	// The index doubled since the last partition, spread it again. Too
+	// many blocks changed through private views, write a checkpoint
+	bool spread = db->index.getNumSplits() - split_mark >= (unsigned int)nodes_mark;
+	if (spread || db->num_changed > CHECKPOINT_BLOCKS) {
+		for (unsigned int i = 0; i < shards.size(); i++)
+			dispatch(shards[i].get());
+		waitIdle();
+		if (spread)
+			partition();
+		else
+			db->checkpointFiles();
+	}
+	return resOK;
+}
+
+void DNS_DB::ShardedWriter::finish() {
+	if (finished)
+		return;
+
+	for (unsigned int i = 0; i < shards.size(); i++)
+		dispatch(shards[i].get());
+	for (unsigned int i = 0; i < shards.size(); i++)
+		shards[i]->queue.close();
+	for (unsigned int i = 0; i < shards.size(); i++)
+		shards[i]->thread.join();
+
+	finished = true;
+	// Nothing was logged, a crash goes back to the previous checkpoint
+	db->checkpointFiles();
+	db->updateIterators();
+	db->dblock.unlock();
+}
+
+void DNS_DB::ShardedWriter::dispatch(Shard * s) {
+	if (s->pending.empty())
+		return;
+
+	{
+		std::lock_guard <std::mutex> g(idle_lock);
+		inflight++;
+	}
+	std::vector <char> batch;
+	batch.reserve(WRITER_BATCH * MAX_DNS_SIZE);
+	batch.swap(s->pending);
+	s->queue.push(std::move(batch));
+}
+
+void DNS_DB::ShardedWriter::waitIdle() {
+	std::unique_lock <std::mutex> g(idle_lock);
+	while (inflight > 0)
+		idle.wait(g);
+}
+
+void DNS_DB::ShardedWriter::writer(Shard * s) {
+	std::vector <char> batch;
+	while (s->queue.pop(batch)) {
+		unsigned long added = 0, dups = 0;
+		unsigned int n = batch.size() / MAX_DNS_SIZE;
+		for (unsigned int i = 0; i < n; i++) {
+			queryError r = db->index.addIDomain(&batch[i*MAX_DNS_SIZE]);
+			if (r == resOK)
+				added++;
+			else if (r == resAlreadyExists)
+				dups++;
+		}
+		num_added += added;
+		num_dups += dups;
+
+		std::lock_guard <std::mutex> g(idle_lock);
+		if (--inflight == 0)
+			idle.notify_all();
+	}
+}
+
+// Splits the nodes in nactive contiguous ranges of (about) the same size.
+// Must be called with all the writers idle
+void DNS_DB::ShardedWriter::partition() {
+	int nnodes = db->index.getNumNodes();
+	nactive = (int)shards.size() < nnodes ? shards.size() : nnodes;
+	if (nactive < 1) nactive = 1;
+
+	bounds.resize(nactive * MAX_DNS_SIZE);
+	for (unsigned int i = 0; i < nactive; i++)
+		db->index.getBlkMin((unsigned long)i * nnodes / nactive, &bounds[i*MAX_DNS_SIZE]);
+
+	split_mark = db->index.getNumSplits();
+	nodes_mark = nnodes;
+	num_partitions++;
+}
+
+// Last shard whose first key is <= domint
+int DNS_DB::ShardedWriter::route(const char * domint) const {
+	int first = 0, last = nactive - 1;
+	while (first < last) {
+		int middle = (first+last+1)>>1;
+		if (less_eq(&bounds[middle*MAX_DNS_SIZE], domint))
+			first = middle;
+		else
+			last = middle - 1;
+	}
+	return first;
+}
+
@@ -9,47 +9,57 @@
 #include "dns_db.h"
 
 
-// Domain is somewhat compressed. Remove the .something and concat a character
-const char * tld_domains[] = {
-	"",
-	"com", "org", "net", "int", "edu", "gov", "mil", 
-	"biz", "info",
-	"at", "ca", "de", "es", "ru", "us", "fr", "se",
-};
-
+// Domain is somewhat compressed. Replace the .suffix with its code (see
+// public_suffix.cc), one or two bytes
 bool domain2idom(const char * domain, char * intdom) {
-	const char * dot = strstr(domain,".");
+	const char * dot = strchr(domain, '.');
 	if (dot == NULL) return false;
 
-	uintptr_t length = ((uintptr_t)dot) - ((uintptr_t)domain);
-	if (length > 34) return false;
-
-	int tldn = -1;
-	for (unsigned int i = 0; i < sizeof(tld_domains)/sizeof(tld_domains[0]); i++) {
-		if (strcmp(dot+1, tld_domains[i]) == 0) {
-			tldn = i;
-			break;
-		}
-	}
+	unsigned int length = dot - domain;
+	unsigned int slen = strlen(dot+1);
+	unsigned int code = suffix2code(dot+1, slen);
+	if (code == 0) return false;
+	if (length + (code < LEGACY_SUFFIX_CODES ? 1 : 2) > MAX_DNS_SIZE) return false;
 
-	if (tldn < 0) return false;
+	// The label must be ASCII so the codes can be told apart
+	for (unsigned int i = 0; i < length; i++)
+		if (domain[i] & 0x80) return false;
 
 	memset(intdom, 0, MAX_DNS_SIZE);
 	memcpy(intdom, domain, length);
-	intdom[length] = (char)tldn;
+	if (code < LEGACY_SUFFIX_CODES)
+		intdom[length] = (char)code;
+	else {
+		intdom[length]   = (char)(0x80 + code / 255);
+		intdom[length+1] = (char)(1 + code % 255);
+	}
 	return true;
 }
 
 void idom2domain(const char * intdom, char * domain) {
-	int length = MAX_DNS_SIZE;
-	if (intdom[MAX_DNS_SIZE-1] == 0)
-		length = strlen(intdom);
+	int length = strnlen(intdom, MAX_DNS_SIZE);
 
-	int ext = (int)intdom[length-1];
+	unsigned int code = (unsigned char)intdom[length-1];
+	if (length >= 2 && (intdom[length-2] & 0x80)) {
+		length--;
+		code = ((unsigned char)intdom[length-1] - 0x80) * 255 + code - 1;
+	}
+	const char * suffix = code2suffix(code);
 	memcpy(domain, intdom, length-1);
 	domain[length-1] = '.';
-	domain[length] = 0;
-	strcat(domain, tld_domains[ext]);
+	strcpy(&domain[length], suffix ? suffix : "");
 }
 
+uint64_t word_hash(const void * data, unsigned long len) {
+	// FNV-1a on 64 bit words (read with memcpy, data might be of any type)
+	const char * p = (const char *)data;
+	uint64_t h = 14695981039346656037ULL;
+	for (unsigned long i = 0; i < len / 8; i++) {
+		uint64_t w;
+		memcpy(&w, p + i*8, sizeof(w));
+		h ^= w;
+		h *= 1099511628211ULL;
+	}
+	return h ^ (h >> 32);
+}
 
@@ -0,0 +1,258 @@
+
+#include <string>
+#include <string.h>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include "dns_db.h"
+
+/** Write-ahead log */
+
+// Log file format: a header (padded to WAL_HEADER bytes) followed by fixed
+// size records with consecutive sequence numbers, starting right after the
+// last checkpoint. Records carry a checksum, so a group which was only
+// partly written (crash during a commit) is found and cut off on open.
+// A checkpoint (once the DB files are synced) truncates the log and
+// writes down the last sequence number it covers. The header also tells
+// whether the DB was closed cleanly, then there is nothing to recover.
+//
+// Recovery goes back to the last checkpoint and redoes the changes logged
+// after it, in order, so replaying does not need them to be idempotent.
+// For that the DB files must be as of the checkpoint:
+// - checkpoints write a copy of the index (index.ckpt, with the sequence
+//   number of the checkpoint, see mark());
+// - the blocks it has are changed through private views (see
+//   DNS_DB::makePrivate), their files are left alone. The next checkpoint
+//   saves the pages which changed (blocks.ckpt, before index.ckpt) and
+//   only then writes them to the files, so recovery writes them again;
+// - blocks created since are not in it, they are written in place. The
+//   ones merged away since are released (their IDs given out again) once
+//   the next checkpoint is written.
+//
+// The log is only started (and marked in use) by the first change, so
+// readers never need recovery. The bulk loader and the sharded writer
+// are not logged, a crash rolls them back to the last checkpoint.
+//
+// Records are buffered and written (and synced, if WAL_SYNC) in groups:
+// by the writer which fills a group of WAL_GROUP_RECORDS, by the flusher
+// thread every WAL_GROUP_MS, or on an explicit commit().
+
+#define WAL_MAGIC    0x314c4157   // "WAL1"
+#define WAL_VERSION  1
+#define WAL_HEADER   64
+
+struct LogHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t clean;        // Closed cleanly, the log is empty
+	uint32_t pad;
+	uint64_t checkpoint;   // Last sequence number checkpointed
+	uint64_t checksum;     // Of this header
+};
+
+DNS_DB::WriteAheadLog::WriteAheadLog() : fd(-1), active(false), stopping(false), next_lsn(1), log_size(0), num_records(0), num_commits(0) {
+	static_assert(sizeof(Record) % 8 == 0, "Log records are hashed in 64 bit words");
+	static_assert(sizeof(LogHeader) <= WAL_HEADER, "Bad log header size");
+}
+
+uint32_t DNS_DB::WriteAheadLog::checksum(Record r) {
+	r.check = 0;
+	return word_hash(&r, sizeof(r));
+}
+
+DNS_DB::WriteAheadLog::~WriteAheadLog() {
+	stop();
+	if (fd >= 0)
+		::close(fd);
+}
+
+// Returns whether the DB was closed cleanly, otherwise the records after
+// the last checkpoint are returned (to be replayed)
+bool DNS_DB::WriteAheadLog::open(const std::string & file, std::vector <Record> & replay) {
+	fd = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open the write-ahead log %s!\n", file.c_str());
+		exit(1);
+	}
+
+	// New log (DBs created before it existed count as clean)
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size == 0) {
+		log_size = WAL_HEADER;
+		writeHeader(0, true);
+		return true;
+	}
+
+	LogHeader h;
+	uint64_t sum = 0;
+	if (pread(fd, &h, sizeof(h), 0) == sizeof(h)) {
+		sum = h.checksum;
+		h.checksum = 0;
+	}
+	if (size < WAL_HEADER || h.magic != WAL_MAGIC || h.version != WAL_VERSION || sum != word_hash(&h, sizeof(h))) {
+		fprintf(stderr, "Bad write-ahead log %s!\n", file.c_str());
+		exit(1);
+	}
+
+	// Read up to the first torn (or stale) record
+	next_lsn = h.checkpoint + 1;
+	off_t pos = WAL_HEADER;
+	std::vector <Record> buf(4096);
+	while (pos < size) {
+		ssize_t r = pread(fd, &buf[0], buf.size() * sizeof(Record), pos);
+		unsigned int n = r > 0 ? r / sizeof(Record) : 0, i = 0;
+		for (; i < n && buf[i].lsn == next_lsn && buf[i].check == checksum(buf[i]); i++, next_lsn++)
+			replay.push_back(buf[i]);
+		pos += i * sizeof(Record);
+		if (i < buf.size())
+			break;
+	}
+	if (pos < size && ftruncate(fd, pos) < 0) {
+		fprintf(stderr, "Could not truncate the write-ahead log %s!\n", file.c_str());
+		exit(1);
+	}
+	log_size = pos;
+
+	if (h.clean)
+		replay.clear();
+	return h.clean;
+}
+
+// Marks the log in use (a crash from now on needs recovery) and starts
+// logging the changes
+void DNS_DB::WriteAheadLog::start() {
+	writeHeader(next_lsn - 1, false);
+	active = true;
+	flusher = std::thread(&DNS_DB::WriteAheadLog::flush, this);
+}
+
+void DNS_DB::WriteAheadLog::stop() {
+	if (!flusher.joinable())
+		return;
+	{
+		std::lock_guard <std::mutex> g(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	flusher.join();
+	commit();
+}
+
+// Returns the sequence number of the record (0 if the log is not in use)
+uint64_t DNS_DB::WriteAheadLog::append(uint8_t type, const char * domint, const IPv4_Record * rec, const IPv4_Record * newrec) {
+	Record r;
+	memset(&r, 0, sizeof(r));
+	r.type = type;
+	memcpy(r.domain, domint, MAX_DNS_SIZE);
+	if (rec)    r.recs[0] = *rec;
+	if (newrec) r.recs[1] = *newrec;
+	return append(r);
+}
+
+uint64_t DNS_DB::WriteAheadLog::append(Record & r) {
+	if (!active)
+		return 0;
+
+	std::unique_lock <std::mutex> g(lock);
+	r.lsn = next_lsn++;
+	r.check = checksum(r);
+	pending.push_back(r);
+	num_records++;
+	bool full = pending.size() >= WAL_GROUP_RECORDS;
+	g.unlock();
+
+	if (full)
+		commit();
+	return r.lsn;
+}
+
+// Takes a sequence number no record gets, so each checkpoint has its own
+// (even with no logged changes since the previous one)
+uint64_t DNS_DB::WriteAheadLog::mark() {
+	std::lock_guard <std::mutex> g(lock);
+	return next_lsn++;
+}
+
+// Returns once all the records appended so far are written
+void DNS_DB::WriteAheadLog::commit() {
+	std::lock_guard <std::mutex> c(commit_lock);
+	commitGroup();
+}
+
+// Writes the pending records (commit_lock held). Later appends go to the
+// next group while this one is written
+void DNS_DB::WriteAheadLog::commitGroup() {
+	{
+		std::lock_guard <std::mutex> g(lock);
+		writing.swap(pending);
+	}
+	if (writing.empty())
+		return;
+
+	unsigned long len = writing.size() * sizeof(Record);
+	if (pwrite(fd, &writing[0], len, log_size) != (ssize_t)len) {
+		fprintf(stderr, "Could not write the write-ahead log!\n");
+		exit(1);
+	}
+	#if WAL_SYNC
+	fdatasync(fd);
+	#endif
+	log_size += len;
+	num_commits++;
+	writing.clear();
+}
+
+void DNS_DB::WriteAheadLog::flush() {
+	std::unique_lock <std::mutex> g(lock);
+	while (!stopping) {
+		wake.wait_for(g, std::chrono::milliseconds(WAL_GROUP_MS));
+		if (stopping || pending.empty())
+			continue;
+		g.unlock();
+		commit();
+		g.lock();
+	}
+}
+
+// The DB files have all the changes logged so far (they are synced), the
+// log starts over. Clean means the DB is being closed
+void DNS_DB::WriteAheadLog::checkpoint(bool clean) {
+	std::lock_guard <std::mutex> c(commit_lock);
+	commitGroup();
+
+	uint64_t lsn;
+	{
+		std::lock_guard <std::mutex> g(lock);
+		assert(pending.empty());
+		lsn = next_lsn - 1;
+	}
+	// Once the header is written the records are stale anyway
+	writeHeader(lsn, clean);
+	if (ftruncate(fd, WAL_HEADER) < 0) {
+		fprintf(stderr, "Could not truncate the write-ahead log!\n");
+		exit(1);
+	}
+	log_size = WAL_HEADER;
+	if (clean)
+		active = false;
+}
+
+void DNS_DB::WriteAheadLog::writeHeader(uint64_t checkpoint, bool clean) {
+	char buf[WAL_HEADER];
+	memset(buf, 0, sizeof(buf));
+	LogHeader * h = (LogHeader*)buf;
+	h->magic = WAL_MAGIC;
+	h->version = WAL_VERSION;
+	h->clean = clean;
+	h->checkpoint = checkpoint;
+	h->checksum = word_hash(h, sizeof(LogHeader));
+	if (pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf) || fdatasync(fd) < 0) {
+		fprintf(stderr, "Could not write the write-ahead log!\n");
+		exit(1);
+	}
+}